@@ -52,6 +52,17 @@ remove a ban. Mask can be a valid online nickname and will use
 #include "modules/account.h"
 #include "modules/stats.h"
 
+// Bumped whenever a NoCreate is created or destroyed so that cached verdicts
+// can tell that the list has changed.
+static unsigned long nocreate_generation = 0;
+
+// A cached result of checking a user against the NoCreate list
+struct NoCreateVerdict
+{
+	unsigned long generation;
+	XLine* line;
+};
+
 // Store the NoCreate mask as an XLine
 class NoCreate : public XLine
 {
@@ -66,6 +77,12 @@ class NoCreate : public XLine
 	{
 		if ((mask.length() > 2) && (mask[0] == 'U') && (mask[1] == ':'))
 			unreg = true;
+		nocreate_generation++;
+	}
+
+	~NoCreate()
+	{
+		nocreate_generation++;
 	}
 
 	bool Matches(User* user) CXX11_OVERRIDE
@@ -266,18 +283,49 @@ class CommandNoCreate : public Command
 };
 
 // Main module class for NOCREATE
-class ModuleNoCreate : public Module, public Stats::EventListener
+class ModuleNoCreate : public Module, public Stats::EventListener, public AccountEventListener
 {
 	CommandNoCreate cmd;
 	NoCreateFactory factory;
+	SimpleExtItem<NoCreateVerdict> verdicts;
 	bool telluser;
 	bool noisy;
 	std::string default_reason;
 
+	// Checks the user against the NoCreate list, reusing the last result if
+	// neither the list nor the user has changed since.
+	XLine* GetMatchingLine(LocalUser* user)
+	{
+		NoCreateVerdict* verdict = verdicts.get(user);
+		if (verdict && verdict->generation == nocreate_generation)
+		{
+			// An expired line is only removed when the list is next searched.
+			XLine* line = verdict->line;
+			if (!line || !line->duration || ServerInstance->Time() <= line->expiry)
+				return line;
+		}
+
+		XLine* nc = ServerInstance->XLines->MatchesLine("NOCREATE", user);
+
+		// Searching the list may have removed expired lines so the generation
+		// has to be read afterwards.
+		NoCreateVerdict newverdict = { nocreate_generation, nc };
+		verdicts.set(user, newverdict);
+		return nc;
+	}
+
+	void ForgetVerdict(User* user)
+	{
+		if (IS_LOCAL(user))
+			verdicts.unset(user);
+	}
+
  public:
 	ModuleNoCreate()
 		: Stats::EventListener(this)
+		, AccountEventListener(this)
 		, cmd(this)
+		, verdicts("nocreate-verdict", ExtensionItem::EXT_USER, this)
 	{
 	}
 
@@ -321,7 +369,7 @@ class ModuleNoCreate : public Module, public Stats::EventListener
 		if (user->IsOper() || user->exempt)
 			return MOD_RES_PASSTHRU;
 
-		XLine* nc = ServerInstance->XLines->MatchesLine("NOCREATE", user);
+		XLine* nc = GetMatchingLine(user);
 		if (!nc)
 			return MOD_RES_PASSTHRU;
 
@@ -338,6 +386,31 @@ class ModuleNoCreate : public Module, public Stats::EventListener
 		return MOD_RES_DENY;
 	}
 
+	void OnUserPostNick(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		ForgetVerdict(user);
+	}
+
+	void OnChangeHost(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		ForgetVerdict(user);
+	}
+
+	void OnChangeIdent(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		ForgetVerdict(user);
+	}
+
+	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
+	{
+		ForgetVerdict(user);
+	}
+
+	void OnAccountChange(User* user, const std::string&) CXX11_OVERRIDE
+	{
+		ForgetVerdict(user);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Gives /nocreate, an X-line to block users from creating new channels");
@@ -17,7 +17,7 @@
  */
 
 /// $ModAuthor: Sadie Powell <sadie@sadiepowell.dev>
-/// $ModConfig: <antiknock nameregex="(st|sn|cr|pl|pr|fr|fl|qu|br|gr|sh|sk|tr|kl|wr|bl|[bcdfgklmnprstvwz])([aeiou][aeiou][bcdfgklmnprstvwz])(ed|est|er|le|ly|y|ies|iest|ian|ion|est|ing|led|inger|[abcdfgklmnprstvwz])" docmd="yes" dokill="yes" donick="yes" donotice="yes" doreal="yes" doshun="yes" douser="yes" shunduration="15" shunreason="User was caught in an antiknock trap">
+/// $ModConfig: <antiknock engine="pcre2" statschar="n" nameregex="(st|sn|cr|pl|pr|fr|fl|qu|br|gr|sh|sk|tr|kl|wr|bl|[bcdfgklmnprstvwz])([aeiou][aeiou][bcdfgklmnprstvwz])(ed|est|er|le|ly|y|ies|iest|ian|ion|est|ing|led|inger|[abcdfgklmnprstvwz])" docmd="yes" dokill="yes" donick="yes" donotice="yes" doreal="yes" doshun="yes" douser="yes" shunduration="15" shunreason="User was caught in an antiknock trap">
 /// $ModDesc: Attempts to block a common IRC spambot.
 /// $ModDepends: core 4
 
@@ -26,10 +26,13 @@
 
 #include "inspircd.h"
 #include "extension.h"
+#include "modules/regex.h"
 #include "modules/shun.h"
+#include "modules/stats.h"
 
 class ModuleAntiKnocker final
 	: public Module
+	, public Stats::EventListener
 {
 public:
 	bool docmd;
@@ -39,10 +42,34 @@ public:
 	bool doreal;
 	bool doshun;
 	bool douser;
+	Regex::EngineReference rf;
+	Regex::PatternPtr namepattern;
 	std::regex nameregex;
 	IntExtItem seenmsg;
 	unsigned long shunduration;
 	std::string shunreason;
+	char statschar;
+
+	// Counters for how expensive checking names is.
+	unsigned long namechecks = 0;
+	unsigned long namehits = 0;
+	std::chrono::steady_clock::duration nametime { };
+	std::chrono::steady_clock::duration namepeak { };
+
+	bool IsKnockerName(const std::string& name)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		// The pattern can not be used if the engine which created it has gone.
+		const bool matched = namepattern ? rf && namepattern->IsMatch(name) : std::regex_match(name, nameregex);
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+
+		namechecks++;
+		if (matched)
+			namehits++;
+		nametime += elapsed;
+		namepeak = std::max(namepeak, elapsed);
+		return matched;
+	}
 
 	void PunishUser(LocalUser* user)
 	{
@@ -72,6 +99,8 @@ public:
 
 	ModuleAntiKnocker()
 		: Module(VF_NONE, "Attempts to block a common IRC spambot.")
+		, Stats::EventListener(this)
+		, rf(this, "regex")
 		, seenmsg(this, "seenmsg", ExtensionType::USER)
 	{
 	}
@@ -81,15 +110,43 @@ public:
 		const auto& tag = ServerInstance->Config->ConfValue("antiknock");
 
 		const std::string nick = tag->getString("nameregex", "(st|sn|cr|pl|pr|fr|fl|qu|br|gr|sh|sk|tr|kl|wr|bl|[bcdfgklmnprstvwz])([aeiou][aeiou][bcdfgklmnprstvwz])(ed|est|er|le|ly|y|ies|iest|ian|ion|est|ing|led|inger|[abcdfgklmnprstvwz])");
-		try
+		const std::string engine = tag->getString("engine");
+		if (engine.empty())
 		{
-			std::regex newnameregex(nick);
-			std::swap(nameregex, newnameregex);
-			ServerInstance->Logs.Debug(MODNAME, "Name regex set to {}", nick);
+			// No engine has been configured so fall back to std::regex.
+			try
+			{
+				std::regex newnameregex(nick, std::regex::optimize);
+				std::swap(nameregex, newnameregex);
+				namepattern = nullptr;
+				ServerInstance->Logs.Debug(MODNAME, "Name regex set to {} (using std::regex)", nick);
+			}
+			catch (const std::regex_error& err)
+			{
+				throw ModuleException(this, INSP_FORMAT("<antiknock:nameregex> is invalid: {}", err.what()));
+			}
 		}
-		catch (const std::regex_error& err)
+		else
 		{
-			throw ModuleException(this, INSP_FORMAT("<antiknock:nameregex> is invalid: {}", err.what()));
+			Regex::EngineReference newrf(this, engine);
+			if (!newrf)
+				throw ModuleException(this, "<antiknock:engine> (" + engine + ") is not a recognised regex engine.");
+
+			// Names have to be matched in their entirety like std::regex_match does.
+			Regex::PatternPtr newnamepattern;
+			try
+			{
+				newnamepattern = newrf->Create("^(" + nick + ")$");
+			}
+			catch (const Regex::Exception& err)
+			{
+				throw ModuleException(this, "<antiknock:nameregex> is not a well formed regular expression: " + err.GetReason());
+			}
+
+			rf.SetProvider(newrf.GetProvider());
+			std::swap(namepattern, newnamepattern);
+			nameregex = std::regex();
+			ServerInstance->Logs.Debug(MODNAME, "Name regex set to {} (using the {} engine)", nick, engine);
 		}
 
 		docmd = tag->getBool("docmd", true);
@@ -101,6 +158,19 @@ public:
 		douser = tag->getBool("douser", true);
 		shunduration = tag->getDuration("shunduration", 60*15, 60);
 		shunreason = tag->getString("shunreason", "User was caught in an antiknock trap", 1);
+		statschar = tag->getCharacter("statschar", 'n');
+	}
+
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() != statschar)
+			return MOD_RES_PASSTHRU;
+
+		const auto totalus = std::chrono::duration_cast<std::chrono::microseconds>(nametime).count();
+		const auto peakus = std::chrono::duration_cast<std::chrono::microseconds>(namepeak).count();
+		stats.AddGenericRow(INSP_FORMAT("Knocker name checks: {} ({} matched) using {}, {}us total, {}us peak",
+			namechecks, namehits, namepattern ? (rf ? rf->name : "<unloaded engine>") : "std::regex", totalus, peakus));
+		return MOD_RES_DENY;
 	}
 
 	ModResult OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated) override
@@ -134,7 +204,7 @@ public:
 
 	ModResult OnUserPreNick(LocalUser* user, const std::string& newnick) override
 	{
-		if (!donick || !std::regex_match(newnick, nameregex))
+		if (!donick || !IsKnockerName(newnick))
 			return MOD_RES_PASSTHRU;
 
 		ServerInstance->SNO.WriteToSnoMask('a', "User {} ({}) [{}] (class: {}) was prevented from using a knocker nickname: {}",
@@ -147,7 +217,7 @@ public:
 	void OnChangeRealUser(User* user, const std::string& newuser) override
 	{
 		auto* luser = IS_LOCAL(user);
-		if (!luser || !douser || !std::regex_match(newuser, nameregex))
+		if (!luser || !douser || !IsKnockerName(newuser))
 			return;
 
 		ServerInstance->SNO.WriteToSnoMask('a', "User {} ({}) [{}] (class: {}) was prevented from using a knocker username: {}",
@@ -159,7 +229,7 @@ public:
 	void OnChangeRealName(User* user, const std::string& newreal) override
 	{
 		auto* luser = IS_LOCAL(user);
-		if (!luser || !douser || !std::regex_match(newreal, nameregex))
+		if (!luser || !douser || !IsKnockerName(newreal))
 			return;
 
 		ServerInstance->SNO.WriteToSnoMask('a', "User {} ({}) [{}] (class: {}) was prevented from using a knocker real name: {}",
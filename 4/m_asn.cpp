@@ -17,6 +17,9 @@
  */
 
 /// $ModAuthor: Sadie Powell <sadie@sadiepowell.dev>
+/// $ModConfig: <asn cachesize="10000" cachettl="1h" negativettl="5m" database="ip2asn.bin">
+/// $ModConfig: <asnthrottle connections="20" period="1m" exempt="13335 64512-65534" maxtracked="10000" noticeinterval="1m" reason="Too many connections from your network">
+/// $ModConfig: <connect asnthrottle="no">
 /// $ModDepends: core 4
 /// $ModDesc: Allows banning users based on Autonomous System number.
 
@@ -28,6 +31,14 @@
 #include "modules/stats.h"
 #include "modules/whois.h"
 
+#include <fstream>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
 enum
 {
 	// InspIRCd-specific.
@@ -35,14 +46,120 @@ enum
 	RPL_STATSASN = 800,
 };
 
+// Stores the ASN of a user and keeps count of how many users are in each ASN.
+class ASNExtItem final
+	: public IntExtItem
+{
+private:
+	std::map<intptr_t, size_t> counts;
+
+	void Count(intptr_t asn, bool add)
+	{
+		if (!asn)
+			return; // Users with no ASN are not counted.
+
+		if (add)
+		{
+			counts[asn]++;
+			return;
+		}
+
+		auto it = counts.find(asn);
+		if (it != counts.end() && !--it->second)
+			counts.erase(it);
+	}
+
+public:
+	ASNExtItem(Module* Creator)
+		: IntExtItem(Creator, "asn", ExtensionType::USER, true)
+	{
+	}
+
+	void Delete(Extensible* container, void* item) override
+	{
+		// This is called when a user is destroyed whether they registered
+		// or not so it is the only place that sees every removal.
+		Count(reinterpret_cast<intptr_t>(item), false);
+		IntExtItem::Delete(container, item);
+	}
+
+	void FromNetwork(Extensible* container, const std::string& value) noexcept override
+	{
+		const intptr_t oldasn = Get(container);
+		IntExtItem::FromNetwork(container, value);
+		Count(oldasn, false);
+		Count(Get(container), true);
+	}
+
+	void SetASN(User* user, intptr_t asn)
+	{
+		Count(Get(user), false);
+		Set(user, asn);
+		Count(asn, true);
+	}
+
+	void UnsetASN(User* user, bool sync = true)
+	{
+		Count(Get(user), false);
+		Unset(user, sync);
+	}
+
+	const std::map<intptr_t, size_t>& GetCounts() const
+	{
+		return counts;
+	}
+};
+
+// A range of ASNs which has been parsed from a mask like "13335" or "64512-65534".
+struct ASNRange final
+{
+	intptr_t first;
+	intptr_t last;
+
+	bool Contains(intptr_t asn) const
+	{
+		return asn >= first && asn <= last;
+	}
+
+	// Determines whether the specified text is an ASN written in the same way
+	// as ConvToStr would write it. ASNs are 32-bit so they have at most 10 digits.
+	static bool IsCanonical(const std::string& text)
+	{
+		if (text.empty() || text.length() > 10 || text.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+		return text.length() == 1 || text[0] != '0';
+	}
+
+	static std::optional<ASNRange> Parse(const std::string& text)
+	{
+		const size_t sep = text.find('-');
+		const std::string first = text.substr(0, sep);
+		const std::string last = sep == std::string::npos ? first : text.substr(sep + 1);
+		if (!IsCanonical(first) || !IsCanonical(last))
+			return std::nullopt;
+
+		ASNRange range = { ConvToNum<intptr_t>(first), ConvToNum<intptr_t>(last) };
+		if (range.first > range.last)
+			return std::nullopt;
+		return range;
+	}
+};
+
 class ASNExtBan final
 	: public ExtBan::MatchingBase
 {
 private:
-	IntExtItem& asnext;
+	// The maximum number of parsed masks to keep before starting again.
+	static constexpr size_t MAX_PARSED = 1000;
+
+	ASNExtItem& asnext;
+
+	// Masks which have already been parsed into a range of ASNs or
+	// std::nullopt if they are not written as a number or range.
+	std::unordered_map<std::string, std::optional<ASNRange>> parsed;
 
 public:
-	ASNExtBan(Module* Creator, IntExtItem& asn)
+	ASNExtBan(Module* Creator, ASNExtItem& asn)
 		: ExtBan::MatchingBase(Creator, "asn", 'b')
 		, asnext(asn)
 	{
@@ -50,8 +167,427 @@ public:
 
 	bool IsMatch(User* user, Channel* channel, const std::string& text) override
 	{
-		const std::string asnstr = ConvToStr(asnext.Get(user));
-		return insp::equalsci(asnstr, text);
+		auto it = parsed.find(text);
+		if (it == parsed.end())
+		{
+			if (parsed.size() >= MAX_PARSED)
+				parsed.clear();
+			it = parsed.emplace(text, ASNRange::Parse(text)).first;
+		}
+
+		if (it->second)
+			return it->second->Contains(asnext.Get(user));
+
+		// Not a number or range so compare it as text like we always have.
+		return insp::equalsci(ConvToStr(asnext.Get(user)), text);
+	}
+};
+
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
+{
+private:
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
+	{
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+// Caches the results of ASN lookups by the prefix that the ASN announces so
+// that one lookup can answer for every address within that prefix.
+class ASNCache final
+{
+public:
+	struct Entry final
+	{
+		// The autonomous system which announces this range or 0 if none does.
+		intptr_t asn;
+
+		// The range of addresses which this entry covers.
+		irc::sockets::cidr_mask range;
+
+		// The time at which this entry expires.
+		time_t expires;
+	};
+
+private:
+	using EntryList = std::list<Entry>;
+
+	// The cached entries from the oldest to the newest.
+	EntryList entries;
+
+	// The cached entries by the range which they cover.
+	CIDRTree<EntryList::iterator> tree;
+
+	// The maximum number of entries to cache.
+	size_t maxentries = 10000;
+
+	void Erase(EntryList::iterator it)
+	{
+		tree.Remove(it->range, it);
+		entries.erase(it);
+	}
+
+public:
+	void Add(const irc::sockets::cidr_mask& range, intptr_t asn, unsigned long ttl)
+	{
+		const auto* existing = tree.Get(range);
+		if (existing)
+			Erase(existing->front());
+
+		entries.push_back({ asn, range, ServerInstance->Time() + static_cast<time_t>(ttl) });
+		tree.Add(range, std::prev(entries.end()));
+		SetMaxEntries(maxentries);
+	}
+
+	// Finds the most specific unexpired entry which covers the specified address.
+	const Entry* Find(const irc::sockets::sockaddrs& sa)
+	{
+		std::vector<EntryList::iterator> found;
+		tree.Find(sa, found);
+		for (auto it = found.rbegin(); it != found.rend(); ++it)
+		{
+			if ((*it)->expires > ServerInstance->Time())
+				return &**it;
+		}
+		return nullptr;
+	}
+
+	void SetMaxEntries(size_t max)
+	{
+		maxentries = max;
+		while (entries.size() > maxentries)
+			Erase(entries.begin());
+	}
+};
+
+// A read-only table of IP ranges and the ASN that announces them. This is
+// created from an ip2asn TSV dump using the ip2asn-convert script.
+//
+// The file starts with an 8 byte magic value followed by the number of IPv4
+// and IPv6 records as 32-bit big-endian integers. The IPv4 records (4 byte
+// start, 4 byte end, 4 byte ASN) follow and then the IPv6 records (16 byte
+// start, 16 byte end, 4 byte ASN). All values are big-endian and the records
+// of each family are sorted by their start address and do not overlap.
+class ASNDatabase final
+{
+private:
+	static constexpr std::string_view MAGIC = std::string_view("IP2ASN\x00\x01", 8);
+	static constexpr size_t HEADER_SIZE = 16;
+
+	// The contents of the database file.
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	// The buffer the database was read into.
+	std::vector<unsigned char> buffer;
+#endif
+
+	// The number of IPv4 and IPv6 records.
+	uint32_t count4;
+	uint32_t count6;
+
+	static uint32_t ReadInt(const unsigned char* bytes)
+	{
+		return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+	}
+
+	// Finds the ASN for an address of the specified length in a record table.
+	static uint32_t Search(const unsigned char* records, size_t count, const unsigned char* address, size_t length)
+	{
+		// Find the first record which starts after the address.
+		const size_t recordsize = (length * 2) + 4;
+		size_t low = 0;
+		size_t high = count;
+		while (low < high)
+		{
+			const size_t middle = low + ((high - low) / 2);
+			if (memcmp(records + (middle * recordsize), address, length) <= 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		// The record before that is the only one which could contain it.
+		if (!low)
+			return 0;
+
+		const unsigned char* record = records + ((low - 1) * recordsize);
+		if (memcmp(record + length, address, length) < 0)
+			return 0;
+
+		return ReadInt(record + (length * 2));
+	}
+
+	static bool IsSorted(const unsigned char* records, size_t count, size_t length)
+	{
+		const size_t recordsize = (length * 2) + 4;
+		for (size_t idx = 0; idx < count; ++idx)
+		{
+			const unsigned char* record = records + (idx * recordsize);
+			if (memcmp(record, record + length, length) > 0)
+				return false; // Starts after it ends.
+
+			if (idx && memcmp(record - recordsize + length, record, length) >= 0)
+				return false; // Overlaps with the previous record.
+		}
+		return true;
+	}
+
+	void Load(const std::string& file)
+	{
+#ifdef _WIN32
+		std::ifstream stream(file, std::ios::binary);
+		if (!stream.is_open())
+			throw CoreException(INSP_FORMAT("Unable to open {}: {}", file, strerror(errno)));
+
+		buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+		data = buffer.data();
+		size = buffer.size();
+#else
+		int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw CoreException(INSP_FORMAT("Unable to open {}: {}", file, strerror(errno)));
+
+		struct stat sb;
+		if (fstat(fd, &sb) || !sb.st_size)
+		{
+			close(fd);
+			throw CoreException(INSP_FORMAT("Unable to read {}: file is empty", file));
+		}
+
+		void* map = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			throw CoreException(INSP_FORMAT("Unable to map {}: {}", file, strerror(errno)));
+
+		data = static_cast<const unsigned char*>(map);
+		size = sb.st_size;
+#endif
+	}
+
+public:
+	ASNDatabase(const std::string& file)
+	{
+		Load(file);
+		if (size < HEADER_SIZE || memcmp(data, MAGIC.data(), MAGIC.length()))
+		{
+			Unload();
+			throw CoreException(file + " is not an ip2asn database");
+		}
+
+		count4 = ReadInt(data + 8);
+		count6 = ReadInt(data + 12);
+		if (size != HEADER_SIZE + (size_t(count4) * 12) + (size_t(count6) * 36))
+		{
+			Unload();
+			throw CoreException(file + " is truncated or corrupt");
+		}
+
+		if (!IsSorted(data + HEADER_SIZE, count4, 4) || !IsSorted(data + HEADER_SIZE + (size_t(count4) * 12), count6, 16))
+		{
+			Unload();
+			throw CoreException(file + " contains unsorted or overlapping ranges");
+		}
+	}
+
+	~ASNDatabase()
+	{
+		Unload();
+	}
+
+	void Unload()
+	{
+#ifndef _WIN32
+		if (data)
+			munmap(const_cast<unsigned char*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	// Finds the ASN which announces the specified address or 0 if none do.
+	uint32_t Lookup(const irc::sockets::sockaddrs& sa) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				return Search(data + HEADER_SIZE, count4, reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr), 4);
+
+			case AF_INET6:
+				return Search(data + HEADER_SIZE + (size_t(count4) * 12), count6, sa.in6.sin6_addr.s6_addr, 16);
+
+			default:
+				return 0;
+		}
+	}
+
+	size_t GetRangeCount() const
+	{
+		return size_t(count4) + count6;
 	}
 };
 
@@ -61,8 +597,41 @@ class ASNResolver final
 private:
 	irc::sockets::sockaddrs theirsa;
 	std::string theiruuid;
-	IntExtItem& asnext;
+	ASNExtItem& asnext;
 	BoolExtItem& asnpendingext;
+	ASNCache& cache;
+	unsigned long cachettl;
+	unsigned long negativettl;
+
+	// Caches that there is no ASN for the address being looked up.
+	void CacheNegative()
+	{
+		const unsigned char length = theirsa.family() == AF_INET ? 32 : 64;
+		cache.Add(irc::sockets::cidr_mask(theirsa, length), 0, negativettl);
+	}
+
+	// Caches the ASN for the prefix listed in the reply (e.g. "13335 | 1.1.1.0/24 | ...").
+	void CachePositive(const DNS::ResourceRecord* record, intptr_t asn)
+	{
+		std::string prefix;
+		irc::sepstream fieldstream(record->rdata, '|');
+		if (fieldstream.GetToken(prefix) && fieldstream.GetToken(prefix))
+		{
+			const size_t start = prefix.find_first_not_of(' ');
+			const size_t end = prefix.find_last_not_of(' ');
+			prefix = start == std::string::npos ? "" : prefix.substr(start, end - start + 1);
+		}
+
+		const irc::sockets::cidr_mask range(prefix);
+		if (prefix.empty() || !range.match(theirsa))
+		{
+			// The prefix is missing or malformed so we can only cache this address.
+			cache.Add(irc::sockets::cidr_mask(theirsa, theirsa.family() == AF_INET ? 32 : 128), asn, std::min<unsigned long>(record->ttl, cachettl));
+			return;
+		}
+
+		cache.Add(range, asn, std::min<unsigned long>(record->ttl, cachettl));
+	}
 
 	std::string GetDNS(LocalUser* user)
 	{
@@ -94,38 +663,54 @@ private:
 
 
 public:
-	ASNResolver(DNS::Manager* dns, Module* Creator, LocalUser* user, IntExtItem& asn, BoolExtItem& asnpending)
+	ASNResolver(DNS::Manager* dns, Module* Creator, LocalUser* user, ASNExtItem& asn, BoolExtItem& asnpending, ASNCache& asncache, unsigned long cttl, unsigned long nttl)
 		: DNS::Request(dns, Creator, GetDNS(user), DNS::QUERY_TXT, true)
 		, theirsa(user->client_sa)
 		, theiruuid(user->uuid)
 		, asnext(asn)
 		, asnpendingext(asnpending)
+		, cache(asncache)
+		, cachettl(cttl)
+		, negativettl(nttl)
 	{
 	}
 
 	void OnLookupComplete(const DNS::Query* result) override
 	{
+		// The DNS reply must contain an TXT result.
+		const DNS::ResourceRecord* record = result->FindAnswerOfType(DNS::QUERY_TXT);
+
+		size_t pos = record ? record->rdata.find_first_not_of("0123456789") : 0;
+		intptr_t asn = record ? ConvToNum<uintptr_t>(record->rdata.substr(0, pos)) : 0;
+
+		// Cache the result even if the user has gone so that other users from
+		// the same network can use it.
+		if (asn)
+			CachePositive(record, asn);
+		else
+			CacheNegative();
+
 		auto* them = ServerInstance->Users.FindUUID<LocalUser>(theiruuid);
 		if (!them || them->client_sa != theirsa)
 			return;
 
-		// The DNS reply must contain an TXT result.
-		const DNS::ResourceRecord* record = result->FindAnswerOfType(DNS::QUERY_TXT);
-		if (!record)
+		if (!asn)
 		{
 			asnpendingext.Unset(them);
 			return;
 		}
 
-		size_t pos = record->rdata.find_first_not_of("0123456789");
-		intptr_t asn = ConvToNum<uintptr_t>(record->rdata.substr(0, pos));
-		asnext.Set(them, asn);
+		asnext.SetASN(them, asn);
 		asnpendingext.Unset(them);
 		ServerInstance->Logs.Debug(MODNAME, "ASN for {} ({}) is {}", them->uuid, them->GetAddress(), asn);
 	}
 
 	void OnError(const DNS::Query* query) override
 	{
+		// Addresses which are not announced by any AS do not have a record.
+		if (query->error == DNS::ERROR_DOMAIN_NOT_FOUND || query->error == DNS::ERROR_NO_RECORDS)
+			CacheNegative();
+
 		auto* them = ServerInstance->Users.FindUUID<LocalUser>(theiruuid);
 		if (!them || them->client_sa != theirsa)
 			return;
@@ -136,33 +721,265 @@ public:
 	}
 };
 
+// Limits the rate at which users can connect from a single autonomous system
+// using a token bucket for each ASN.
+class ASNThrottle final
+{
+private:
+	struct Bucket final
+	{
+		// The number of connections which can currently be accepted.
+		double tokens;
+
+		// The time at which the tokens were last refilled.
+		time_t updated;
+	};
+
+	// The buckets for each ASN which has recently had a connection.
+	std::unordered_map<intptr_t, Bucket> buckets;
+
+	// The number of connections which have been throttled since the last notice.
+	std::map<intptr_t, unsigned long> throttled;
+
+	// The time at which the last notice was sent.
+	time_t lastnotice = 0;
+
+	// Removes buckets which have refilled and, if that is not enough, the one
+	// which has been unused for the longest time.
+	void Prune()
+	{
+		const time_t now = ServerInstance->Time();
+		auto oldest = buckets.end();
+		for (auto it = buckets.begin(); it != buckets.end(); )
+		{
+			if (it->second.tokens + ((now - it->second.updated) * rate) >= burst)
+			{
+				it = buckets.erase(it);
+				continue;
+			}
+
+			if (oldest == buckets.end() || it->second.updated < oldest->second.updated)
+				oldest = it;
+			++it;
+		}
+
+		if (buckets.size() >= maxtracked && oldest != buckets.end())
+			buckets.erase(oldest);
+	}
+
+public:
+	// The maximum number of connections from an ASN at once or 0 if disabled.
+	double burst = 0;
+
+	// The number of connections which are allowed per second.
+	double rate;
+
+	// The maximum number of ASNs to keep buckets for.
+	size_t maxtracked;
+
+	// The interval between notices about throttled connections.
+	unsigned long noticeinterval;
+
+	// The ASNs which are not throttled.
+	std::vector<ASNRange> exempt;
+
+	// Determines whether a connection from the specified ASN is allowed.
+	bool Allow(intptr_t asn)
+	{
+		if (!asn || !burst)
+			return true;
+
+		for (const auto& range : exempt)
+		{
+			if (range.Contains(asn))
+				return true;
+		}
+
+		const time_t now = ServerInstance->Time();
+		auto it = buckets.find(asn);
+		if (it == buckets.end())
+		{
+			if (buckets.size() >= maxtracked)
+				Prune();
+			it = buckets.emplace(asn, Bucket { burst, now }).first;
+		}
+
+		auto& bucket = it->second;
+		bucket.tokens = std::min(burst, bucket.tokens + ((now - bucket.updated) * rate));
+		bucket.updated = now;
+		if (bucket.tokens < 1)
+		{
+			throttled[asn]++;
+			return false;
+		}
+
+		bucket.tokens--;
+		return true;
+	}
+
+	// Sends a single notice about all of the connections which have been
+	// throttled since the last one if the notice interval has passed.
+	void SendNotice(time_t now)
+	{
+		if (throttled.empty() || now - lastnotice < static_cast<time_t>(noticeinterval))
+			return;
+
+		std::vector<std::pair<unsigned long, intptr_t>> sorted;
+		unsigned long total = 0;
+		for (const auto& [asn, count] : throttled)
+		{
+			sorted.emplace_back(count, asn);
+			total += count;
+		}
+		std::sort(sorted.begin(), sorted.end(), std::greater<>());
+
+		std::string worst;
+		for (size_t idx = 0; idx < std::min<size_t>(sorted.size(), 5); ++idx)
+			worst.append(INSP_FORMAT("{}AS{} ({})", idx ? ", " : "", sorted[idx].second, sorted[idx].first));
+
+		ServerInstance->SNO.WriteGlobalSno('a', "Throttled {} connection(s) from {} autonomous system(s) in the last {}: {}{}",
+			total, sorted.size(), Duration::ToString(now - lastnotice), worst, sorted.size() > 5 ? ", ..." : "");
+
+		throttled.clear();
+		lastnotice = now;
+	}
+
+	// Applies new limits to the existing buckets after a rehash.
+	void Reconfigure()
+	{
+		if (!lastnotice)
+			lastnotice = ServerInstance->Time();
+
+		if (!burst)
+		{
+			buckets.clear();
+			return;
+		}
+
+		for (auto it = buckets.begin(); it != buckets.end(); )
+		{
+			const bool isexempt = std::any_of(exempt.begin(), exempt.end(), [&it](const ASNRange& range) {
+				return range.Contains(it->first);
+			});
+			if (isexempt)
+			{
+				it = buckets.erase(it);
+				continue;
+			}
+
+			it->second.tokens = std::min(burst, it->second.tokens);
+			++it;
+		}
+
+		while (buckets.size() > maxtracked)
+			Prune();
+	}
+};
+
 class ModuleASN final
 	: public Module
 	, public Stats::EventListener
 	, public Whois::EventListener
 {
 private:
-	IntExtItem asnext;
+	ASNExtItem asnext;
 	ASNExtBan asnextban;
 	BoolExtItem asnpendingext;
+	BoolExtItem asnthrottledext;
 	DNS::ManagerRef dns;
+	ASNCache cache;
+	unsigned long cachettl;
+	unsigned long negativettl;
+	std::shared_ptr<ASNDatabase> database;
+	ASNThrottle throttle;
+	std::string throttlereason;
 
 public:
 	ModuleASN()
 		: Module(VF_OPTCOMMON, "Allows banning users based on Autonomous System number.")
 		, Stats::EventListener(this)
 		, Whois::EventListener(this)
-		, asnext(this, "asn", ExtensionType::USER, true)
+		, asnext(this)
 		, asnextban(this, asnext)
 		, asnpendingext(this, "asn-pending", ExtensionType::USER)
+		, asnthrottledext(this, "asn-throttle-checked", ExtensionType::USER)
 		, dns(this)
 	{
 	}
 
+	void ReadConfig(ConfigStatus& status) override
+	{
+		const auto& tag = ServerInstance->Config->ConfValue("asn");
+		cache.SetMaxEntries(tag->getNum<size_t>("cachesize", 10000));
+		cachettl = tag->getDuration("cachettl", 60*60);
+		negativettl = tag->getDuration("negativettl", 5*60);
+
+		const auto& throttletag = ServerInstance->Config->ConfValue("asnthrottle");
+		std::vector<ASNRange> newexempt;
+		irc::spacesepstream exemptstream(throttletag->getString("exempt"));
+		for (std::string token; exemptstream.GetToken(token); )
+		{
+			const auto range = ASNRange::Parse(token);
+			if (!range)
+				throw ModuleException(this, "<asnthrottle:exempt> contains an invalid ASN or ASN range: " + token);
+			newexempt.push_back(*range);
+		}
+
+		throttle.exempt = std::move(newexempt);
+		throttle.burst = throttletag->getNum<unsigned long>("connections", 0);
+		throttle.rate = throttle.burst / throttletag->getDuration("period", 60, 1);
+		throttle.maxtracked = throttletag->getNum<size_t>("maxtracked", 10000, 1);
+		throttle.noticeinterval = throttletag->getDuration("noticeinterval", 60, 1);
+		throttlereason = throttletag->getString("reason", "Too many connections from your network", 1);
+		throttle.Reconfigure();
+
+		const std::string dbfile = tag->getString("database");
+		if (dbfile.empty())
+		{
+			database.reset();
+			return;
+		}
+
+		// Load and check the new database before we replace the old one so a
+		// failed load leaves the old one in use.
+		std::shared_ptr<ASNDatabase> newdatabase;
+		const std::string dbpath = ServerInstance->Config->Paths.PrependData(dbfile);
+		try
+		{
+			newdatabase = std::make_shared<ASNDatabase>(dbpath);
+		}
+		catch (const CoreException& ex)
+		{
+			throw ModuleException(this, "Unable to load <asn:database>: " + ex.GetReason());
+		}
+
+		database = std::move(newdatabase);
+		ServerInstance->Logs.Normal(MODNAME, "Loaded {} ranges from {}", database->GetRangeCount(), dbpath);
+	}
+
 	ModResult OnCheckReady(LocalUser* user) override
 	{
 		// Block until ASN info is available.
-		return asnpendingext.Get(user) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+		if (asnpendingext.Get(user))
+			return MOD_RES_DENY;
+
+		// Only take a token once per connection even if other modules are
+		// still holding registration.
+		if (asnthrottledext.Get(user))
+			return MOD_RES_PASSTHRU;
+
+		asnthrottledext.Set(user);
+		const auto& klass = user->GetClass();
+		if ((klass && !klass->config->getBool("asnthrottle", true)) || throttle.Allow(asnext.Get(user)))
+			return MOD_RES_PASSTHRU;
+
+		ServerInstance->Users.QuitUser(user, throttlereason);
+		return MOD_RES_DENY;
+	}
+
+	void OnBackgroundTimer(time_t now) override
+	{
+		throttle.SendNotice(now);
 	}
 
 	void OnChangeRemoteAddress(LocalUser* user) override
@@ -173,11 +990,33 @@ public:
 		if (!user->GetClass() || !user->GetClass()->config->getBool("useasn", true))
 			return;
 
-		asnext.Unset(user);
+		asnext.UnsetASN(user);
+		asnthrottledext.Unset(user);
 		if (!user->client_sa.is_ip())
 			return;
 
-		auto* resolver = new ASNResolver(*dns, this, user, asnext, asnpendingext);
+		if (database)
+		{
+			// The local database is used instead of DNS when it is available.
+			const uint32_t asn = database->Lookup(user->client_sa);
+			if (asn)
+				asnext.SetASN(user, asn);
+			ServerInstance->Logs.Debug(MODNAME, "ASN for {} ({}) is {} (from database)", user->uuid,
+				user->GetAddress(), asn);
+			return;
+		}
+
+		const auto* cached = cache.Find(user->client_sa);
+		if (cached)
+		{
+			if (cached->asn)
+				asnext.SetASN(user, cached->asn);
+			ServerInstance->Logs.Debug(MODNAME, "ASN for {} ({}) is {} (cached from {})", user->uuid,
+				user->GetAddress(), cached->asn, cached->range.str());
+			return;
+		}
+
+		auto* resolver = new ASNResolver(*dns, this, user, asnext, asnpendingext, cache, cachettl, negativettl);
 		try
 		{
 			asnpendingext.Set(user);
@@ -218,15 +1057,16 @@ public:
 		if (stats.GetSymbol() != 'b')
 			return MOD_RES_PASSTHRU;
 
-		std::map<intptr_t, size_t> counts;
-		for (const auto& [_, u] : ServerInstance->Users.GetUsers())
-		{
-			intptr_t asn = asnext.Get(u);
-			if (!counts.insert(std::make_pair(asn, 1)).second)
-				counts[asn]++;
-		}
+		// Users with an unknown ASN are not counted so work out how many
+		// there are from the total number of users.
+		size_t unknown = ServerInstance->Users.GetUsers().size();
+		for (const auto& [_, count] : asnext.GetCounts())
+			unknown -= std::min(unknown, count);
+
+		if (unknown)
+			stats.AddRow(RPL_STATSASN, 0, unknown);
 
-		for (const auto& [asn, count] : counts)
+		for (const auto& [asn, count] : asnext.GetCounts())
 			stats.AddRow(RPL_STATSASN, asn, count);
 		return MOD_RES_DENY;
 	}
@@ -17,21 +17,107 @@
  */
 
 /// $ModAuthor: Sadie Powell <sadie@sadiepowell.dev>
-/// $ModConfig: <autokick message="Banned">
+/// $ModConfig: <autokick message="Banned" maxkicks="50">
 /// $ModDepends: core 4
 /// $ModDesc: Automatically kicks people who match a banned mask.
 
 
 #include "inspircd.h"
+#include "listmode.h"
+
+// The members which matched a ban and are waiting to be kicked.
+struct PendingKicks final
+{
+	// The name of the channel the ban was set on.
+	std::string channel;
+
+	// The mask that was banned.
+	std::string mask;
+
+	// The nick of the user who set the ban.
+	std::string source;
+
+	// The rank of the user who set the ban.
+	ModeHandler::Rank rank;
+
+	// The UUIDs of the matching members and the position of the next one to kick.
+	std::vector<std::string> users;
+	size_t position = 0;
+
+	// The number of members which have been kicked.
+	size_t kicked = 0;
+};
 
 class ModeWatcherBan final
 	: public ModeWatcher
 {
+private:
+	ChanModeReference banmode;
+	std::deque<PendingKicks> pending;
+
+	bool IsBanned(Channel* channel, const std::string& mask)
+	{
+		ListModeBase* banlm = banmode ? banmode->IsListModeBase() : nullptr;
+		const ListModeBase::ModeList* list = banlm ? banlm->GetList(channel) : nullptr;
+		if (!list)
+			return false;
+
+		for (const auto& entry : *list)
+		{
+			if (entry.mask == mask)
+				return true;
+		}
+		return false;
+	}
+
+	// Kicks the members of a pending ban until either they have all been
+	// kicked or the limit is reached. Returns whether the ban is finished.
+	bool KickMembers(PendingKicks& kicks, size_t& remaining)
+	{
+		// If the channel has gone or the ban has been removed then there is
+		// nothing left to do.
+		Channel* channel = ServerInstance->Channels.Find(kicks.channel);
+		if (!channel || !IsBanned(channel, kicks.mask))
+			return true;
+
+		while (kicks.position < kicks.users.size() && remaining)
+		{
+			// The member may have left or been given a higher rank since the
+			// ban was set.
+			auto* user = ServerInstance->Users.FindUUID(kicks.users[kicks.position++]);
+			if (!user || user->quitting || !channel->HasUser(user))
+				continue;
+
+			if (kicks.rank <= channel->GetPrefixValue(user) || !channel->CheckBan(user, kicks.mask))
+				continue;
+
+			channel->KickUser(ServerInstance->FakeClient, user, reason);
+			kicks.kicked++;
+			remaining--;
+
+			// The channel is deleted when the last member is kicked.
+			if (!ServerInstance->Channels.Find(kicks.channel))
+				return true;
+		}
+		return kicks.position >= kicks.users.size();
+	}
+
+	void Finish(const PendingKicks& kicks)
+	{
+		if (!kicks.kicked)
+			return;
+
+		ServerInstance->SNO.WriteToSnoMask('a', "Automatically kicked {} of {} members of {} matching the ban on {} set by {}",
+			kicks.kicked, kicks.users.size(), kicks.channel, kicks.mask, kicks.source);
+	}
+
 public:
 	std::string reason;
+	size_t maxkicks;
 
 	ModeWatcherBan(Module* Creator)
 		: ModeWatcher(Creator, "ban", MODETYPE_CHANNEL)
+		, banmode(Creator, "ban")
 	{
 	}
 
@@ -39,22 +125,65 @@ public:
 	{
 		if (change.adding)
 		{
-			ModeHandler::Rank rank = channel->GetPrefixValue(source);
-
-			const Channel::MemberMap& users = channel->GetUsers();
-			auto iter = users.begin();
+			PendingKicks kicks;
+			kicks.channel = channel->name;
+			kicks.mask = change.param;
+			kicks.source = source->nick;
+			kicks.rank = channel->GetPrefixValue(source);
 
-			while (iter != users.end())
+			// Collect the matching members first and kick them over the
+			// next few ticks to avoid flooding the network.
+			for (const auto& [user, _] : channel->GetUsers())
 			{
-				// KickUser invalidates the iterator so copy and increment it here.
-				auto it = iter++;
-				if (IS_LOCAL(it->first) && rank > channel->GetPrefixValue(it->first) && channel->CheckBan(it->first, change.param))
-				{
-					channel->KickUser(ServerInstance->FakeClient, it->first, reason.c_str());
-				}
+				if (IS_LOCAL(user) && kicks.rank > channel->GetPrefixValue(user) && channel->CheckBan(user, change.param))
+					kicks.users.push_back(user->uuid);
 			}
+
+			if (kicks.users.empty())
+				return;
+
+			// Small bans are dealt with straight away if nothing else is
+			// waiting to be kicked.
+			size_t remaining = maxkicks;
+			if (pending.empty() && KickMembers(kicks, remaining))
+				Finish(kicks);
+			else
+				pending.push_back(std::move(kicks));
 		}
 	}
+
+	void Tick()
+	{
+		size_t remaining = maxkicks;
+		while (!pending.empty() && remaining)
+		{
+			if (!KickMembers(pending.front(), remaining))
+				break;
+
+			Finish(pending.front());
+			pending.pop_front();
+		}
+	}
+};
+
+class KickTimer final
+	: public Timer
+{
+private:
+	ModeWatcherBan& watcher;
+
+public:
+	KickTimer(ModeWatcherBan& mw)
+		: Timer(1, true)
+		, watcher(mw)
+	{
+	}
+
+	bool Tick() override
+	{
+		watcher.Tick();
+		return true;
+	}
 };
 
 class ModuleAutoKick final
@@ -62,18 +191,26 @@ class ModuleAutoKick final
 {
 private:
 	ModeWatcherBan mw;
+	KickTimer timer;
 
 public:
 	ModuleAutoKick()
 		: Module(VF_OPTCOMMON, "Automatically kicks people who match a banned mask.")
 		, mw(this)
+		, timer(mw)
+	{
+	}
+
+	void init() override
 	{
+		ServerInstance->Timers.AddTimer(&timer);
 	}
 
 	void ReadConfig(ConfigStatus& status) override
 	{
 		const auto& tag = ServerInstance->Config->ConfValue("autokick");
 		mw.reason = tag->getString("message", "Banned");
+		mw.maxkicks = tag->getNum<size_t>("maxkicks", 50, 1);
 	}
 };
 
@@ -17,36 +17,275 @@
  */
 
 /// $ModAuthor: Sadie Powell <sadie@sadiepowell.dev>
+/// $ModConfig: <blocksock statschar="B">
 /// $ModDepends: core 4
 /// $ModDesc: Allows blocking IP addresses from making any socket connections to the server.
 
 
 #include "inspircd.h"
+#include "modules/stats.h"
 
-class ModuleBlockSock final
-	: public Module
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
 {
 private:
-	bool FindRange(const std::string& rangelist, const irc::sockets::sockaddrs& sa)
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
 	{
-		if (rangelist.empty())
-			return false; // No ranges set.
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
 
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+// A compiled whitelist or blacklist from a <bind> tag.
+class RangeList final
+{
+private:
+	// Ranges which are plain IP addresses or CIDR ranges.
+	CIDRTree<std::string> prefixes;
+
+	// Ranges which contain wildcards or have an unusual prefix length. These are
+	// matched against "ip:port" and parsed as a CIDR range on every check.
+	std::vector<std::string> wildcards;
+
+public:
+	// The number of connections which have matched this list.
+	unsigned long matches = 0;
+
+	RangeList(const std::string& rangelist)
+	{
 		irc::spacesepstream rangestream(rangelist);
-		const auto sastr = sa.str();
 		for (std::string range; rangestream.GetToken(range); )
 		{
-			if (InspIRCd::Match(sastr, range, ascii_case_insensitive_map) || irc::sockets::cidr_mask(range).match(sa))
-				return true; // Matches the range.
+			irc::sockets::cidr_mask cidr;
+			if (range.find_first_of("*?") == std::string::npos && CIDRTree<std::string>::ParseRange(range, cidr))
+				prefixes.Add(cidr, range);
+			else
+				wildcards.push_back(range);
 		}
+	}
 
-		// No range matched.
-		return false;
+	bool Matches(const irc::sockets::sockaddrs& sa)
+	{
+		bool matched = prefixes.Contains(sa);
+		if (!matched && !wildcards.empty())
+		{
+			const auto sastr = sa.str();
+			for (const auto& wildcard : wildcards)
+			{
+				if (InspIRCd::Match(sastr, wildcard, ascii_case_insensitive_map) || irc::sockets::cidr_mask(wildcard).match(sa))
+				{
+					matched = true;
+					break;
+				}
+			}
+		}
+
+		if (matched)
+			matches++;
+		return matched;
+	}
+};
+
+// The compiled lists for a listener.
+struct ListenerLists final
+{
+	// The <bind> tag the lists were compiled from.
+	std::shared_ptr<ConfigTag> tag;
+
+	RangeList whitelist;
+	RangeList blacklist;
+
+	ListenerLists(const std::shared_ptr<ConfigTag>& bindtag)
+		: tag(bindtag)
+		, whitelist(bindtag->getString("whitelist"))
+		, blacklist(bindtag->getString("blacklist"))
+	{
+	}
+};
+
+class ModuleBlockSock final
+	: public Module
+	, public Stats::EventListener
+{
+private:
+	std::unordered_map<ListenSocket*, std::unique_ptr<ListenerLists>> listeners;
+	char statschar;
+
+	ListenerLists& GetLists(ListenSocket* ls)
+	{
+		// If the listener has been recreated since we last saw it then the
+		// lists need to be compiled again.
+		auto& lists = listeners[ls];
+		if (!lists || lists->tag != ls->bind_tag)
+			lists = std::make_unique<ListenerLists>(ls->bind_tag);
+		return *lists;
 	}
 
 public:
 	ModuleBlockSock()
 		: Module(VF_NONE, "Allows blocking IP addresses from making any socket connections to the server.")
+		, Stats::EventListener(this)
 	{
 	}
 
@@ -55,17 +294,48 @@ public:
 		ServerInstance->Modules.SetPriority(this, I_OnAcceptConnection, PRIORITY_FIRST);
 	}
 
-	ModResult OnAcceptConnection(int, ListenSocket* from, const irc::sockets::sockaddrs& client, const irc::sockets::sockaddrs& server) override
+	void ReadConfig(ConfigStatus& status) override
 	{
-		const auto whiteliststr = from->bind_tag->getString("whitelist");
-		if (!FindRange(whiteliststr, client))
+		const auto& tag = ServerInstance->Config->ConfValue("blocksock");
+		statschar = tag->getCharacter("statschar", 'B');
+
+		// Compile the lists for the current listeners up front rather than on
+		// the first connection.
+		std::unordered_map<ListenSocket*, std::unique_ptr<ListenerLists>> newlisteners;
+		for (auto* ls : ServerInstance->ports)
 		{
-			const auto blackliststr = from->bind_tag->getString("blacklist");
-			if (FindRange(blackliststr, client))
-				return MOD_RES_DENY;
+			auto it = listeners.find(ls);
+			if (it != listeners.end() && it->second->tag == ls->bind_tag)
+				newlisteners.emplace(ls, std::move(it->second));
+			else
+				newlisteners.emplace(ls, std::make_unique<ListenerLists>(ls->bind_tag));
 		}
+		listeners.swap(newlisteners);
+	}
+
+	ModResult OnAcceptConnection(int, ListenSocket* from, const irc::sockets::sockaddrs& client, const irc::sockets::sockaddrs& server) override
+	{
+		auto& lists = GetLists(from);
+		if (!lists.whitelist.Matches(client) && lists.blacklist.Matches(client))
+			return MOD_RES_DENY;
 		return MOD_RES_PASSTHRU;
 	}
+
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() != statschar)
+			return MOD_RES_PASSTHRU;
+
+		// Entries for listeners which have been closed may still be in the map
+		// so we walk the active listeners instead.
+		for (auto* ls : ServerInstance->ports)
+		{
+			const auto& lists = GetLists(ls);
+			stats.AddGenericRow(INSP_FORMAT("blocksock {}: {} whitelisted, {} blacklisted",
+				ls->bind_sa.str(), lists.whitelist.matches, lists.blacklist.matches));
+		}
+		return MOD_RES_DENY;
+	}
 };
 
 MODULE_INIT(ModuleBlockSock)
@@ -23,6 +23,7 @@
  */
 
 /// $ModAuthor: InspIRCd Developers
+/// $ModConfig: <clones ipv4="32 24 16" ipv6="64 48">
 /// $ModDepends: core 4
 /// $ModDesc: Adds the /CLONES command which allows server operators to view IP addresses from which there are more than a specified number of connections.
 /// $ModLink: https://docs.inspircd.org/4/moved-modules/#clones
@@ -30,6 +31,7 @@
 
 #include "inspircd.h"
 #include "clientprotocolmsg.h"
+#include "extension.h"
 #include "modules/ircv3_batch.h"
 
 enum
@@ -38,6 +40,167 @@ enum
 	RPL_CLONES = 399
 };
 
+// The number of users connecting from a CIDR range.
+struct CloneCounts final
+{
+	size_t local = 0;
+	size_t global = 0;
+};
+
+// Keeps track of how many users are connected from the ranges of a single
+// prefix length along with an index of the ranges ordered by user count.
+class CloneLevel final
+{
+ public:
+	using RankIndex = std::set<std::pair<size_t, irc::sockets::cidr_mask>, std::greater<>>;
+
+ private:
+	std::map<irc::sockets::cidr_mask, CloneCounts> ranges;
+	RankIndex ranked;
+
+ public:
+	const int family;
+	const unsigned char length;
+
+	CloneLevel(int fam, unsigned char len)
+		: family(fam)
+		, length(len)
+	{
+	}
+
+	void Update(const irc::sockets::sockaddrs& sa, bool local, bool add)
+	{
+		const irc::sockets::cidr_mask range(sa, length);
+		auto& counts = ranges[range];
+		if (counts.global)
+			ranked.erase(std::make_pair(counts.global, range));
+
+		if (add)
+		{
+			counts.global++;
+			if (local)
+				counts.local++;
+		}
+		else
+		{
+			counts.global--;
+			if (local)
+				counts.local--;
+		}
+
+		if (counts.global)
+			ranked.emplace(counts.global, range);
+		else
+			ranges.erase(range);
+	}
+
+	const CloneCounts& GetCounts(const irc::sockets::cidr_mask& range) const
+	{
+		return ranges.find(range)->second;
+	}
+
+	const RankIndex& GetRanked() const
+	{
+		return ranked;
+	}
+};
+
+class CloneIndex final
+{
+ private:
+	// Stores the address a user was counted under and uncounts them when it
+	// is removed. This happens whenever a user is destroyed so users who quit
+	// before they finish registering are also uncounted.
+	class CountedExtItem final
+		: public SimpleExtItem<irc::sockets::sockaddrs>
+	{
+	 private:
+		CloneIndex& index;
+
+	 public:
+		CountedExtItem(Module* Creator, CloneIndex& idx)
+			: SimpleExtItem<irc::sockets::sockaddrs>(Creator, "clones-counted", ExtensionType::USER)
+			, index(idx)
+		{
+		}
+
+		void Delete(Extensible* container, void* item) override
+		{
+			index.Update(static_cast<User*>(container), *static_cast<irc::sockets::sockaddrs*>(item), false);
+			SimpleExtItem<irc::sockets::sockaddrs>::Delete(container, item);
+		}
+	};
+
+	std::vector<CloneLevel> levels;
+
+	// The lengths used when none is specified. These are the same as the ones
+	// the core uses for its clone counts.
+	unsigned char defaultlength4 = 32;
+	unsigned char defaultlength6 = 128;
+
+	// The address each counted user was counted under.
+	CountedExtItem countedext;
+
+	void Update(User* user, const irc::sockets::sockaddrs& sa, bool add)
+	{
+		const bool local = IS_LOCAL(user);
+		for (auto& level : levels)
+		{
+			if (level.family == sa.family())
+				level.Update(sa, local, add);
+		}
+	}
+
+ public:
+	CloneIndex(Module* Creator)
+		: countedext(Creator, *this)
+	{
+	}
+
+	void Add(User* user)
+	{
+		if (!user->client_sa.is_ip() || countedext.Get(user))
+			return;
+
+		countedext.Set(user, user->client_sa);
+		Update(user, user->client_sa, true);
+	}
+
+	void Remove(User* user)
+	{
+		countedext.Unset(user);
+	}
+
+	void Rebuild(std::vector<CloneLevel>&& newlevels, unsigned char length4, unsigned char length6)
+	{
+		// Users have to be uncounted from the old levels before they are replaced.
+		const auto& users = ServerInstance->Users.GetUsers();
+		for (const auto& [_, user] : users)
+			countedext.Unset(user);
+
+		levels = std::move(newlevels);
+		defaultlength4 = length4;
+		defaultlength6 = length6;
+		for (const auto& [_, user] : users)
+			Add(user);
+	}
+
+	// Retrieves the level for the specified family at the specified length or
+	// at the core clone length if it is zero.
+	const CloneLevel* GetLevel(int family, unsigned char length) const
+	{
+		if (!length)
+			length = family == AF_INET ? defaultlength4 : defaultlength6;
+
+		for (const auto& level : levels)
+		{
+			if (level.family == family && level.length == length)
+				return &level;
+		}
+		return nullptr;
+	}
+};
+
 class CommandClones : public SplitCommand
 {
  private:
@@ -45,19 +208,38 @@ class CommandClones : public SplitCommand
 	IRCv3::Batch::Batch batch;
 
  public:
+	CloneIndex index;
+
 	CommandClones(Module* Creator)
-		: SplitCommand(Creator,"CLONES", 1)
+		: SplitCommand(Creator,"CLONES", 1, 3)
 		, batchmanager(Creator)
 		, batch("inspircd.org/clones")
+		, index(Creator)
 	{
 		access_needed = CmdAccess::OPERATOR;
-		syntax = { "<limit>" };
+		syntax = { "<limit> [<cidr-length>] [<max-results>]" };
 	}
 
 	CmdResult HandleLocal(LocalUser* user, const Params& parameters) override
 	{
 		auto limit = ConvToNum<unsigned int>(parameters[0]);
 
+		unsigned char length = 0;
+		if (parameters.size() > 1)
+		{
+			const std::string& lengthstr = parameters[1];
+			length = ConvToNum<unsigned char>(lengthstr[0] == '/' ? lengthstr.substr(1) : lengthstr);
+			if (!length || (!index.GetLevel(AF_INET, length) && !index.GetLevel(AF_INET6, length)))
+			{
+				user->WriteNotice("*** CLONES: Ranges of that length are not indexed: " + lengthstr);
+				return CmdResult::FAILURE;
+			}
+		}
+
+		size_t maxresults = SIZE_MAX;
+		if (parameters.size() > 2)
+			maxresults = ConvToNum<size_t>(parameters[2]);
+
 		// Syntax of a CLONES reply:
 		// :irc.example.com BATCH +<id> inspircd.org/clones :<min-count>
 		// @batch=<id> :irc.example.com 399 <client> <local-count> <remote-count> <cidr-mask>
@@ -69,14 +251,40 @@ class CommandClones : public SplitCommand
 			batch.GetBatchStartMessage().PushParam(limit);
 		}
 
-		for (const auto& [range, counts] : ServerInstance->Users.GetCloneMap())
+		// The ranges for each family are already ordered by their global count
+		// so we only need to merge them until we drop below the limit.
+		static const CloneLevel::RankIndex empty;
+		const auto* level4 = index.GetLevel(AF_INET, length);
+		const auto* level6 = index.GetLevel(AF_INET6, length);
+		const auto& ranked4 = level4 ? level4->GetRanked() : empty;
+		const auto& ranked6 = level6 ? level6->GetRanked() : empty;
+
+		auto it4 = ranked4.begin();
+		auto it6 = ranked6.begin();
+		for (size_t results = 0; results < maxresults; ++results)
 		{
-			if (counts.global < limit)
-				continue;
+			const CloneLevel* level;
+			CloneLevel::RankIndex::const_iterator it;
+			if (it4 != ranked4.end() && (it6 == ranked6.end() || it4->first >= it6->first))
+			{
+				level = level4;
+				it = it4++;
+			}
+			else if (it6 != ranked6.end())
+			{
+				level = level6;
+				it = it6++;
+			}
+			else
+				break;
+
+			const auto& [global, range] = *it;
+			if (global < limit)
+				break;
 
 			Numeric::Numeric numeric(RPL_CLONES);
-			numeric.push(counts.local);
-			numeric.push(counts.global);
+			numeric.push(level->GetCounts(range).local);
+			numeric.push(global);
 			numeric.push(range.str());
 
 			ClientProtocol::Messages::Numeric numericmsg(numeric, user);
@@ -96,12 +304,74 @@ class ModuleClones : public Module
  private:
 	CommandClones cmd;
 
+	static void AddLevel(int family, unsigned char length, std::vector<CloneLevel>& levels)
+	{
+		for (const auto& level : levels)
+		{
+			if (level.family == family && level.length == length)
+				return; // Already indexed.
+		}
+		levels.emplace_back(family, length);
+	}
+
+	void ReadLengths(const std::shared_ptr<ConfigTag>& tag, const std::string& key, const std::string& def, int family, unsigned char maxlen, std::vector<CloneLevel>& levels)
+	{
+		irc::spacesepstream lengthstream(tag->getString(key, def, 1));
+		for (std::string lengthstr; lengthstream.GetToken(lengthstr); )
+		{
+			const auto length = ConvToNum<unsigned int>(lengthstr);
+			if (!length || length > maxlen)
+				throw ModuleException(this, INSP_FORMAT("<clones:{}> contains an invalid CIDR length: {}", key, lengthstr));
+			AddLevel(family, length, levels);
+		}
+	}
+
  public:
 	ModuleClones()
 		: Module(VF_NONE, "Adds the /CLONES command which allows server operators to view IP addresses from which there are more than a specified number of connections.")
 		, cmd(this)
 	{
 	}
+
+	void ReadConfig(ConfigStatus& status) override
+	{
+		const auto& tag = ServerInstance->Config->ConfValue("clones");
+
+		std::vector<CloneLevel> newlevels;
+		ReadLengths(tag, "ipv4", "32 24 16", AF_INET, 32, newlevels);
+		ReadLengths(tag, "ipv6", "64 48", AF_INET6, 128, newlevels);
+
+		// The ranges the core counts clones in are always indexed so that
+		// /CLONES without a length gives the same results as before.
+		const unsigned char length4 = ServerInstance->Config->c_ipv4_range;
+		const unsigned char length6 = ServerInstance->Config->c_ipv6_range;
+		AddLevel(AF_INET, length4, newlevels);
+		AddLevel(AF_INET6, length6, newlevels);
+		cmd.index.Rebuild(std::move(newlevels), length4, length6);
+	}
+
+	void OnUserInit(LocalUser* user) override
+	{
+		// The core counts users from when they connect so we do too.
+		cmd.index.Add(user);
+	}
+
+	void OnPostConnect(User* user) override
+	{
+		// Remote users are first seen here.
+		cmd.index.Add(user);
+	}
+
+	void OnChangeRemoteAddress(LocalUser* user) override
+	{
+		cmd.index.Remove(user);
+		cmd.index.Add(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) override
+	{
+		cmd.index.Remove(user);
+	}
 };
 
 MODULE_INIT(ModuleClones)
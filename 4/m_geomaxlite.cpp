@@ -18,7 +18,7 @@
 
 /// $ModAuthor: reverse <mike.chevronnet@gmail.com>
 /// $ModDesc: Adds city and country information to WHOIS using a local MaxMind GeoLite2 database with user mode +y.
-/// $ModConfig: <geomaxlite dbpath="path/geodata/GeoLite2-City.mmdb">
+/// $ModConfig: <geomaxlite dbpath="path/geodata/GeoLite2-City.mmdb" cachesize="10000" cacheprefix4="24" cacheprefix6="48" statschar="M">
 /// $ModDepends: core 4
 
 /// $CompilerFlags: find_compiler_flags("libmaxminddb")
@@ -31,32 +31,390 @@
 /// $PackageInfo: require_system("rhel~") pkg-config libmaxminddb-devel
 
 #include "inspircd.h"
+#include "modules/stats.h"
 #include "modules/whois.h"
 #include "extension.h"
+#include <future>
 #include <maxminddb.h>
 
+// Interns location strings so that users from the same place share one copy.
+class LocationTable final
+{
+private:
+    struct Record final
+    {
+        std::string text;
+        size_t refs;
+    };
+
+    // Records indexed by their ID minus one. Unused slots have no references.
+    std::vector<Record> records;
+
+    // Maps location strings to their ID.
+    std::unordered_map<std::string, intptr_t> ids;
+
+    // IDs which were released and can be reused.
+    std::vector<intptr_t> freeids;
+
+public:
+    // Retrieves the ID of the specified location and takes a reference to it.
+    intptr_t Intern(const std::string& text)
+    {
+        auto it = ids.find(text);
+        if (it != ids.end())
+        {
+            AddRef(it->second);
+            return it->second;
+        }
+
+        intptr_t id;
+        if (freeids.empty())
+        {
+            records.push_back({ text, 1 });
+            id = records.size();
+        }
+        else
+        {
+            id = freeids.back();
+            freeids.pop_back();
+            records[id - 1] = { text, 1 };
+        }
+
+        ids.emplace(text, id);
+        return id;
+    }
+
+    void AddRef(intptr_t id)
+    {
+        if (id)
+            records[id - 1].refs++;
+    }
+
+    void Release(intptr_t id)
+    {
+        if (!id)
+            return;
+
+        auto& record = records[id - 1];
+        if (--record.refs)
+            return;
+
+        ids.erase(record.text);
+        record.text.clear();
+        record.text.shrink_to_fit();
+        freeids.push_back(id);
+    }
+
+    const std::string* Get(intptr_t id) const
+    {
+        return id ? &records[id - 1].text : nullptr;
+    }
+
+    // Works out how many bytes of strings would be used with and without interning.
+    std::pair<size_t, size_t> GetMemoryUsage() const
+    {
+        size_t interned = 0;
+        size_t uninterned = 0;
+        for (const auto& record : records)
+        {
+            if (!record.refs)
+                continue;
+
+            const size_t size = sizeof(std::string) + record.text.capacity();
+            interned += size + sizeof(Record);
+            uninterned += size * record.refs;
+        }
+        return std::make_pair(interned, uninterned);
+    }
+
+    size_t GetCount() const
+    {
+        return ids.size();
+    }
+};
+
+// Stores the location of a user as an ID into the location table. The full
+// location string is still used when talking to other servers.
+class LocationExtItem final
+    : public IntExtItem
+{
+private:
+    LocationTable& table;
+
+public:
+    LocationExtItem(Module* Creator, LocationTable& locations)
+        : IntExtItem(Creator, "geomaxlite-country", ExtensionType::USER, true)
+        , table(locations)
+    {
+    }
+
+    void Delete(Extensible* container, void* item) override
+    {
+        // This is called when a user is destroyed whether they registered
+        // or not so it is the only place that sees every removal.
+        table.Release(reinterpret_cast<intptr_t>(item));
+        IntExtItem::Delete(container, item);
+    }
+
+    std::string ToHuman(const Extensible* container, void* item) const noexcept override
+    {
+        return ToNetwork(container, item);
+    }
+
+    std::string ToNetwork(const Extensible* container, void* item) const noexcept override
+    {
+        const std::string* text = table.Get(reinterpret_cast<intptr_t>(item));
+        return text ? *text : std::string();
+    }
+
+    void FromNetwork(Extensible* container, const std::string& value) noexcept override
+    {
+        SetLocation(container, value.empty() ? 0 : table.Intern(value), false);
+    }
+
+    // Sets the location of a user to an ID which the caller has already taken a reference to.
+    void SetLocation(Extensible* container, intptr_t id, bool sync = true)
+    {
+        table.Release(Get(container));
+        if (id)
+            Set(container, id, sync);
+        else
+            Unset(container, sync);
+    }
+
+    const std::string* GetLocation(const Extensible* container) const
+    {
+        return table.Get(Get(container));
+    }
+};
+
+// Remembers the location of recently looked up networks so that the database
+// does not need to be searched for every user from the same network.
+class LocationCache final
+{
+private:
+    using Entry = std::pair<std::string, intptr_t>;
+    using EntryList = std::list<Entry>;
+
+    LocationTable& table;
+
+    // Entries from the most recently used to the least recently used.
+    EntryList entries;
+
+    // Maps prefixes to their entry.
+    std::unordered_map<std::string, EntryList::iterator> index;
+
+public:
+    // The maximum number of prefixes to remember.
+    size_t maxentries = 0;
+
+    // The prefix lengths to cache IPv4 and IPv6 addresses at.
+    unsigned char prefix4;
+    unsigned char prefix6;
+
+    // The number of lookups which were found in or missed the cache.
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+    LocationCache(LocationTable& locations)
+        : table(locations)
+    {
+    }
+
+    ~LocationCache()
+    {
+        Clear();
+    }
+
+    static std::string GetKey(const irc::sockets::sockaddrs& sa, unsigned char length)
+    {
+        const irc::sockets::cidr_mask mask(sa, length);
+        std::string key(reinterpret_cast<const char*>(mask.bits), sizeof(mask.bits));
+        key.push_back(static_cast<char>(mask.type));
+        key.push_back(static_cast<char>(mask.length));
+        return key;
+    }
+
+    unsigned char GetPrefix(const irc::sockets::sockaddrs& sa) const
+    {
+        return sa.family() == AF_INET ? prefix4 : prefix6;
+    }
+
+    // Finds the location ID for a network. Returns true if it was cached.
+    bool Find(const std::string& key, intptr_t& id)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            misses++;
+            return false;
+        }
+
+        hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        id = it->second->second;
+        return true;
+    }
+
+    // Remembers the location ID for a network. This takes its own reference.
+    void Add(const std::string& key, intptr_t id)
+    {
+        if (!maxentries || index.count(key))
+            return;
+
+        table.AddRef(id);
+        entries.emplace_front(key, id);
+        index[key] = entries.begin();
+        while (entries.size() > maxentries)
+        {
+            table.Release(entries.back().second);
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    void Clear()
+    {
+        for (const auto& [_, id] : entries)
+            table.Release(id);
+        entries.clear();
+        index.clear();
+    }
+
+    size_t GetSize() const
+    {
+        return entries.size();
+    }
+};
+
+// An open MaxMind database which is closed once nothing references it.
+using DatabasePtr = std::shared_ptr<MMDB_s>;
+
+// Opens and checks a MaxMind database. This is safe to call from any thread.
+static DatabasePtr OpenDatabase(const std::string& path, std::string& error)
+{
+    auto mmdb = std::make_unique<MMDB_s>();
+    int status_open = MMDB_open(path.c_str(), MMDB_MODE_MMAP, mmdb.get());
+    if (status_open != MMDB_SUCCESS)
+    {
+        error = "Failed to open GeoLite2 database: " + std::string(MMDB_strerror(status_open));
+        return nullptr;
+    }
+
+    DatabasePtr db(mmdb.release(), [](MMDB_s* handle) {
+        MMDB_close(handle);
+        delete handle;
+    });
+
+    // Make sure a lookup works before we start using it
+    int gai_error = 0;
+    int mmdb_error = MMDB_SUCCESS;
+    MMDB_lookup_string(db.get(), "8.8.8.8", &gai_error, &mmdb_error);
+    if (gai_error != 0 || mmdb_error != MMDB_SUCCESS)
+    {
+        error = "GeoLite2 database failed a test lookup: " + std::string(mmdb_error != MMDB_SUCCESS
+            ? MMDB_strerror(mmdb_error) : gai_strerror(gai_error));
+        return nullptr;
+    }
+
+    return db;
+}
+
 class ModuleGeoMaxLite final
     : public Module
+    , public Stats::EventListener
     , public Whois::EventListener
 {
 private:
-    // MaxMind DB handle
-    MMDB_s mmdb;
+    // MaxMind DB handle which lookups are currently using
+    DatabasePtr database;
 
     // Path to the MaxMind database file
     std::string dbpath;
 
+    // The database which is being loaded in the background
+    std::future<std::pair<DatabasePtr, std::string>> loading;
+
+    // Whether another reload was requested while one was in progress
+    bool reloadpending = false;
+
+    void StartReload()
+    {
+        if (loading.valid())
+        {
+            reloadpending = true;
+            return;
+        }
+
+        reloadpending = false;
+        loading = std::async(std::launch::async, [path = dbpath]() {
+            std::string error;
+            DatabasePtr db = OpenDatabase(path, error);
+            return std::make_pair(db, error);
+        });
+    }
+
+    void SwapDatabase(DatabasePtr db)
+    {
+        // The old handle is closed when the last lookup using it finishes
+        database = std::move(db);
+
+        // The database has changed so forget what we have cached
+        cache.Clear();
+    }
+
+    // Interned city/country info strings
+    LocationTable locations;
+
+    // Recently looked up networks
+    LocationCache cache;
+
     // Extension item to store a user's city/country info
-    StringExtItem country_item;
+    LocationExtItem country_item;
 
     // +y user mode for enabling GeoMaxLite lookups
     SimpleUserMode geomaxlite_mode;
 
+    // The stats character which shows the location table usage
+    char statschar;
+
+    // Looks up the location of the specified address in the database and
+    // returns its interned ID or 0 if it is unknown.
+    intptr_t Lookup(MMDB_s* mmdb, const irc::sockets::sockaddrs& sa, uint16_t& netmask)
+    {
+        int gai_error = 0;
+        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(mmdb, &sa.sa, &gai_error);
+
+        // Nothing is known if we got a lookup error or didn't find anything
+        netmask = result.netmask;
+        if (gai_error != 0 || !result.found_entry)
+            return 0;
+
+        // Fetch city and country strings (in English)
+        MMDB_entry_data_s city_data = {};
+        MMDB_entry_data_s country_data = {};
+
+        int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
+        int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
+
+        std::string city = (status_city == MMDB_SUCCESS && city_data.has_data)
+            ? std::string(city_data.utf8_string, city_data.data_size)
+            : "Unknown";
+
+        std::string country = (status_country == MMDB_SUCCESS && country_data.has_data)
+            ? std::string(country_data.utf8_string, country_data.data_size)
+            : "Unknown";
+
+        return locations.Intern("City: " + city + ", Country: " + country);
+    }
+
 public:
     ModuleGeoMaxLite()
         : Module(VF_OPTCOMMON, "Adds city and country information to WHOIS using a local MaxMind GeoLite2 database.")
+        , Stats::EventListener(this)
         , Whois::EventListener(this)
-        , country_item(this, "geomaxlite-country", ExtensionType::USER, true)
+        , cache(locations)
+        , country_item(this, locations)
         , geomaxlite_mode(this, "geomaxlite", 'y', false)
     {
     }
@@ -68,14 +426,49 @@ public:
         dbpath = ServerInstance->Config->Paths.PrependConfig(
             tag->getString("dbpath", "data/GeoLite2-City.mmdb"));
 
-        int status_open = MMDB_open(dbpath.c_str(), MMDB_MODE_MMAP, &mmdb);
-        if (status_open != MMDB_SUCCESS)
+        cache.Clear();
+        cache.maxentries = tag->getNum<size_t>("cachesize", 10000);
+        cache.prefix4 = tag->getNum<unsigned char>("cacheprefix4", 24, 1, 32);
+        cache.prefix6 = tag->getNum<unsigned char>("cacheprefix6", 48, 1, 128);
+        statschar = tag->getCharacter("statschar", 'M');
+
+        if (!status.initial && database)
+        {
+            // Load the new database in the background and keep using the
+            // old one until it is ready
+            StartReload();
+            return;
+        }
+
+        std::string error;
+        DatabasePtr db = OpenDatabase(dbpath, error);
+        if (!db)
         {
             // If the database can't be opened, throw a module exception
-            std::string error_msg = "GeoMaxLite: Failed to open GeoLite2 database: "
-                                  + std::string(MMDB_strerror(status_open));
-            throw ModuleException(this, error_msg.c_str());
+            throw ModuleException(this, "GeoMaxLite: " + error);
+        }
+        SwapDatabase(db);
+    }
+
+    void OnBackgroundTimer(time_t) override
+    {
+        if (!loading.valid() || loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        auto [db, error] = loading.get();
+        if (db)
+        {
+            SwapDatabase(db);
+            ServerInstance->SNO.WriteGlobalSno('a', "GeoMaxLite: Reloaded GeoLite2 database from {}", dbpath);
+        }
+        else
+        {
+            ServerInstance->SNO.WriteGlobalSno('a', "GeoMaxLite: Unable to reload {}, still using the old database: {}",
+                dbpath, error);
         }
+
+        if (reloadpending)
+            StartReload();
     }
 
     void OnWhois(Whois::Context& whois) override
@@ -86,7 +479,7 @@ public:
         if (!target->IsModeSet(geomaxlite_mode))
             return;
 
-        const std::string* info = country_item.Get(target);
+        const std::string* info = country_item.GetLocation(target);
         if (info && !info->empty())
         {
             whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + *info);
@@ -102,44 +495,57 @@ public:
         // If the address is not an IP, unset any stored geo info
         if (!user->client_sa.is_ip())
         {
-            country_item.Unset(user);
+            country_item.SetLocation(user, 0);
             return;
         }
 
-        int gai_error = 0;
-        const struct sockaddr* addr = &user->client_sa.sa;
-        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&mmdb, addr, &gai_error);
-
-        // Unset if we got a lookup error or didn't find anything
-        if (gai_error != 0 || !result.found_entry)
+        // Check whether someone from the same network has been looked up recently
+        intptr_t id = 0;
+        const unsigned char prefix = cache.GetPrefix(user->client_sa);
+        const std::string key = LocationCache::GetKey(user->client_sa, prefix);
+        if (cache.Find(key, id))
         {
-            country_item.Unset(user);
+            locations.AddRef(id);
+            country_item.SetLocation(user, id);
             return;
         }
 
-        // Fetch city and country strings (in English)
-        MMDB_entry_data_s city_data = {};
-        MMDB_entry_data_s country_data = {};
+        // Keep the database open until we are done with it even if it gets swapped
+        DatabasePtr db = database;
 
-        int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
-        int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
+        uint16_t netmask;
+        id = Lookup(db.get(), user->client_sa, netmask);
 
-        std::string city = (status_city == MMDB_SUCCESS && city_data.has_data)
-            ? std::string(city_data.utf8_string, city_data.data_size)
-            : "Unknown";
+        // IPv4 addresses are found at ::a.b.c.d/96 in IPv6 databases
+        if (user->client_sa.family() == AF_INET && db->metadata.ip_version == 6)
+            netmask = netmask > 96 ? netmask - 96 : 0;
 
-        std::string country = (status_country == MMDB_SUCCESS && country_data.has_data)
-            ? std::string(country_data.utf8_string, country_data.data_size)
-            : "Unknown";
+        // Only cache the result if the database network covers the whole prefix
+        if (netmask <= prefix)
+            cache.Add(key, id);
+
+        country_item.SetLocation(user, id);
+    }
+
+    ModResult OnStats(Stats::Context& stats) override
+    {
+        if (stats.GetSymbol() != statschar)
+            return MOD_RES_PASSTHRU;
 
-        // Store
-        country_item.Set(user, "City: " + city + ", Country: " + country);
+        const auto [interned, uninterned] = locations.GetMemoryUsage();
+        stats.AddGenericRow(INSP_FORMAT("GeoMaxLite: {} distinct locations using {} bytes ({} bytes saved by interning)",
+            locations.GetCount(), interned, uninterned > interned ? uninterned - interned : 0));
+        stats.AddGenericRow(INSP_FORMAT("GeoMaxLite: {} cached networks, {} cache hits, {} cache misses",
+            cache.GetSize(), cache.hits, cache.misses));
+        return MOD_RES_DENY;
     }
 
     ~ModuleGeoMaxLite() override
     {
-        // Close the MaxMind DB on unload
-        MMDB_close(&mmdb);
+        // Wait for any background load to finish before we go away. The
+        // MaxMind DB handles are closed when their last reference goes.
+        if (loading.valid())
+            loading.wait();
     }
 };
 
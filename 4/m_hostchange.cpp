@@ -108,6 +108,11 @@ public:
 		return host;
 	}
 
+	const std::string& GetMask() const
+	{
+		return mask;
+	}
+
 	bool Matches(LocalUser* user) const
 	{
 		if (!klass.empty() && !insp::equalsci(klass, user->GetClass()->GetName()))
@@ -136,6 +141,252 @@ public:
 
 typedef std::vector<HostRule> HostRules;
 
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
+{
+private:
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
+	{
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+// Indexes <hostchange> rules by their mask so that only the rules which can
+// possibly match a user have to be checked.
+class HostRuleIndex final
+{
+private:
+	// Rules with a [user@]ip[/prefix] mask.
+	CIDRTree<size_t> cidrs;
+
+	// Rules with a host part which contains no wildcards, keyed by the host part.
+	std::unordered_map<std::string, std::vector<size_t>, irc::insensitive, irc::StrHashComp> literals;
+
+	// Rules which have to be checked against every user.
+	std::vector<size_t> wildcards;
+
+	void FindHost(const std::string& host, std::vector<size_t>& rules) const
+	{
+		auto it = literals.find(host);
+		if (it != literals.end())
+			rules.insert(rules.end(), it->second.begin(), it->second.end());
+
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(host, 0, sa))
+			cidrs.Find(sa, rules);
+	}
+
+public:
+	HostRuleIndex(const HostRules& hostrules)
+	{
+		for (size_t rule = 0; rule < hostrules.size(); ++rule)
+		{
+			// Only the host part of the mask is indexed. Every candidate is
+			// checked with HostRule::Matches so a rule can be indexed under
+			// a host it will not actually match but never the other way.
+			const std::string& mask = hostrules[rule].GetMask();
+			const auto atpos = mask.rfind('@');
+			const std::string hostpart = atpos == std::string::npos ? mask : mask.substr(atpos + 1);
+
+			irc::sockets::cidr_mask range;
+			irc::sockets::sockaddrs sa;
+			if (hostpart.empty() || hostpart.find_first_of("*?") != std::string::npos)
+			{
+				wildcards.push_back(rule);
+			}
+			else if (CIDRTree<size_t>::ParseRange(hostpart, range))
+			{
+				cidrs.Add(range, rule);
+				literals[hostpart].push_back(rule);
+			}
+			else if (hostpart.find('/') != std::string::npos && irc::sockets::aptosa(hostpart.substr(0, hostpart.find('/')), 0, sa))
+			{
+				// MatchCIDR is laxer about prefix lengths than we are.
+				wildcards.push_back(rule);
+			}
+			else
+			{
+				literals[hostpart].push_back(rule);
+			}
+		}
+	}
+
+	// Retrieves the rules which may match the user in config order.
+	void Find(LocalUser* user, std::vector<size_t>& rules) const
+	{
+		rules = wildcards;
+		cidrs.Find(user->client_sa, rules);
+		FindHost(user->GetRealHost(), rules);
+		if (user->GetAddress() != user->GetRealHost())
+			FindHost(user->GetAddress(), rules);
+
+		std::sort(rules.begin(), rules.end());
+		rules.erase(std::unique(rules.begin(), rules.end()), rules.end());
+	}
+};
+
 class ModuleHostChange final
 	: public Module
 {
@@ -143,6 +394,7 @@ private:
 	Account::API accountapi;
 	CharState hostmap;
 	HostRules hostrules;
+	std::unique_ptr<HostRuleIndex> hostindex;
 
 	std::string CleanName(const std::string& name)
 	{
@@ -215,13 +467,17 @@ public:
 			newhostmap.set(static_cast<unsigned char>(chr));
 		}
 		std::swap(newhostmap, hostmap);
+		hostindex = std::make_unique<HostRuleIndex>(rules);
 		hostrules.swap(rules);
 	}
 
 	void OnUserConnect(LocalUser* user) override
 	{
-		for (const auto& rule : hostrules)
+		std::vector<size_t> candidates;
+		hostindex->Find(user, candidates);
+		for (const auto idx : candidates)
 		{
+			const HostRule& rule = hostrules[idx];
 			if (!rule.Matches(user))
 				continue;
 
@@ -19,7 +19,7 @@
 /// $ModAuthor: Jean Chevronnet (reverse) <mike.chevronnet@gmail.com>
 /// $ModDesc: Ip information from Ipinfo.io in /WHOIS (only irc operators), found more information at https://ipinfo.io/developers.
 /// $ModDepends: core 4
-/// $ModConfig: <ipinfo apikey="YOUR IP INFO.IO APIKEY">
+/// $ModConfig: <ipinfo apikey="YOUR IP INFO.IO APIKEY" baseurl="https://ipinfo.io/" threads="4" maxqueue="1000" timeout="10" cachesize="10000" cachettl="1d" cachefile="ipinfo.db" compactinterval="1h" privateranges="" statschar="W">
 /// $CompilerFlags: find_compiler_flags("RapidJSON")
 /// $CompilerFlags: find_compiler_flags("libcurl")
 /// $LinkerFlags: find_linker_flags("libcurl")
@@ -28,22 +28,68 @@
 #include "inspircd.h"
 #include "extension.h"
 #include "modules/httpd.h"
+#include "modules/stats.h"
 #include "modules/whois.h"
-#include "thread.h"
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
 #include <curl/curl.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <mutex>
-#include <regex>
+#include <thread>
 
-class IPInfoResolver : public Thread
+// The result of looking up an IP address.
+struct IPInfoResult final
+{
+    // The IP address which was looked up.
+    std::string ip;
+
+    // The formatted information about the IP address or an empty string on error.
+    std::string info;
+
+    // The reason the lookup failed if it did.
+    std::string error;
+};
+
+// A fixed size pool of threads which look up IP addresses using the ipinfo.io API.
+class IPInfoPool final
 {
 private:
+    // A set of workers which were started with the same settings.
+    struct Generation final
+    {
+        std::condition_variable cv;
+        std::vector<std::thread> workers;
+
+        // IP addresses waiting to be looked up.
+        std::deque<std::string> jobs;
+
+        // Whether the workers should exit once their current lookup is done.
+        bool stopping = false;
+
+        // Whether the workers should abort their current lookup.
+        std::atomic<bool> aborting{false};
+
+        // The number of workers which have not exited yet.
+        size_t running = 0;
+    };
+
     std::mutex mtx;
-    StringExtItem& cachedinfo;
-    std::string apikey;
-    std::string theiruuid;
-    User* resolved_user; // Renamed to avoid shadowing
+
+    // The workers which new lookups are given to.
+    std::shared_ptr<Generation> current;
+
+    // Workers from before the settings changed which are finishing their
+    // current lookup in the background.
+    std::vector<std::shared_ptr<Generation>> retired;
+
+    // Lookups which have finished but have not been handled by the main thread.
+    std::vector<IPInfoResult> results;
 
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s)
     {
@@ -51,107 +97,611 @@ private:
         return size * nmemb;
     }
 
-    void OnStart() override
+    static int ProgressCallback(void* aborting, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+    {
+        // Returning non-zero makes CURL abort the transfer.
+        return static_cast<std::atomic<bool>*>(aborting)->load() ? 1 : 0;
+    }
+
+    static void ParseResponse(IPInfoResult& result, const std::string& response)
     {
-        CURL* curl;
-        CURLcode res;
-        std::string response;
+        rapidjson::Document document;
+        if (document.Parse(response.c_str()).HasParseError())
+        {
+            result.error = INSP_FORMAT("Failed to parse JSON: {}", rapidjson::GetParseError_En(document.GetParseError()));
+            return;
+        }
 
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-        curl = curl_easy_init();
+        auto field = [&document](const char* name) -> std::string {
+            return document.HasMember(name) && document[name].IsString() ? document[name].GetString() : "Unknown";
+        };
+        result.info = "City: " + field("city") + ", Region: " + field("region") + ", Country: " + field("country") + ", Org: " + field("org");
+    }
+
+    void Run(std::shared_ptr<Generation> gen, const std::string baseurl, const std::string apikey, long timeout)
+    {
+        // Each worker keeps its own handle so connections to the API are reused.
+        CURL* curl = curl_easy_init();
         if (curl)
         {
-            std::string url = "https://ipinfo.io/" + resolved_user->client_sa.addr() + "?token=" + apikey;
-            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
             curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-            res = curl_easy_perform(curl);
-            if (res != CURLE_OK)
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &gen->aborting);
+        }
+
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true)
+        {
+            gen->cv.wait(lock, [&gen] { return gen->stopping || !gen->jobs.empty(); });
+            if (gen->stopping)
+                break;
+
+            IPInfoResult result;
+            result.ip = gen->jobs.front();
+            gen->jobs.pop_front();
+            lock.unlock();
+
+            std::string response;
+            if (!curl)
             {
-                std::lock_guard<std::mutex> lock(mtx);
-                ServerInstance->SNO.WriteGlobalSno('a', "IPInfo: Failed to get data for {}: {}", resolved_user->nick, curl_easy_strerror(res));
+                result.error = "Unable to create a CURL handle";
             }
             else
             {
-                ParseResponse(resolved_user, response);
+                const std::string url = baseurl + result.ip + "?token=" + apikey;
+                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+                CURLcode res = curl_easy_perform(curl);
+                if (res != CURLE_OK)
+                    result.error = curl_easy_strerror(res);
+                else
+                    ParseResponse(result, response);
             }
+
+            lock.lock();
+            results.push_back(std::move(result));
+        }
+        lock.unlock();
+
+        if (curl)
             curl_easy_cleanup(curl);
+
+        // This must be the last thing the worker does with the pool.
+        lock.lock();
+        gen->running--;
+    }
+
+    // Joins the retired workers which have exited.
+    void Reap()
+    {
+        std::vector<std::shared_ptr<Generation>> finished;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto it = retired.begin(); it != retired.end(); )
+            {
+                if ((*it)->running)
+                {
+                    ++it;
+                    continue;
+                }
+
+                finished.push_back(*it);
+                it = retired.erase(it);
+            }
+        }
+
+        // The workers have already exited so this will not block.
+        for (const auto& gen : finished)
+        {
+            for (auto& worker : gen->workers)
+                worker.join();
         }
-        curl_global_cleanup();
     }
 
-    void ParseResponse(User* user, const std::string& response)
+public:
+    // The maximum number of IP addresses which can be waiting to be looked up.
+    size_t maxqueue;
+
+    ~IPInfoPool()
     {
-        rapidjson::Document document;
-        if (document.Parse(response.c_str()).HasParseError())
+        Stop();
+    }
+
+    // Starts a new set of workers. Any existing workers finish their current
+    // lookup in the background and their queued lookups are moved over.
+    void Start(size_t threads, const std::string& baseurl, const std::string& apikey, long timeout)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto gen = std::make_shared<Generation>();
+        if (current)
+        {
+            gen->jobs.swap(current->jobs);
+            current->stopping = true;
+            current->cv.notify_all();
+            retired.push_back(std::move(current));
+        }
+
+        gen->running = threads;
+        for (size_t i = 0; i < threads; ++i)
+            gen->workers.emplace_back(&IPInfoPool::Run, this, gen, baseurl, apikey, timeout);
+        current = std::move(gen);
+    }
+
+    // Stops all of the workers and aborts any lookups they are doing.
+    void Stop()
+    {
+        std::vector<std::shared_ptr<Generation>> gens;
         {
             std::lock_guard<std::mutex> lock(mtx);
-           ServerInstance->SNO.WriteGlobalSno('a', "IPInfo: Failed to parse JSON for {}: {}", user->nick, rapidjson::GetParseError_En(document.GetParseError()));
-            return;
+            if (current)
+                retired.push_back(std::move(current));
+            gens.swap(retired);
+
+            for (const auto& gen : gens)
+            {
+                gen->stopping = true;
+                gen->aborting = true;
+                gen->cv.notify_all();
+            }
+        }
+
+        for (const auto& gen : gens)
+        {
+            for (auto& worker : gen->workers)
+                worker.join();
         }
+    }
+
+    // Queues an IP address to be looked up. Returns false if the queue is full.
+    bool Enqueue(const std::string& ip)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!current || current->jobs.size() >= maxqueue)
+            return false;
 
-        std::string city = document.HasMember("city") ? document["city"].GetString() : "Unknown";
-        std::string region = document.HasMember("region") ? document["region"].GetString() : "Unknown";
-        std::string country = document.HasMember("country") ? document["country"].GetString() : "Unknown";
-        std::string org = document.HasMember("org") ? document["org"].GetString() : "Unknown";
+        current->jobs.push_back(ip);
+        current->cv.notify_one();
+        return true;
+    }
 
-        std::string info = "City: " + city + ", Region: " + region + ", Country: " + country + ", Org: " + org;
-        cachedinfo.Set(user, info);
+    // Takes the lookups which have finished since the last call.
+    std::vector<IPInfoResult> TakeResults()
+    {
+        Reap();
 
+        std::vector<IPInfoResult> finished;
         std::lock_guard<std::mutex> lock(mtx);
-        user->WriteNumeric(RPL_WHOISSPECIAL, user->nick, "ip info: " + info);
+        finished.swap(results);
+        return finished;
+    }
+};
+
+// Caches the information about IP addresses even after the users have gone.
+class IPInfoCache final
+{
+private:
+    struct Entry final
+    {
+        std::string info;
+        time_t expires;
+        std::list<std::string>::iterator position;
+    };
+
+    std::unordered_map<std::string, Entry> entries;
+
+    // IP addresses from the oldest to the newest.
+    std::list<std::string> order;
+
+    void Erase(std::unordered_map<std::string, Entry>::iterator it)
+    {
+        order.erase(it->second.position);
+        entries.erase(it);
+    }
+
+public:
+    size_t maxentries;
+    unsigned long ttl;
+
+    // The number of lookups which were found in or missed the cache.
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+    const std::string* Find(const std::string& ip)
+    {
+        auto it = entries.find(ip);
+        if (it == entries.end())
+        {
+            misses++;
+            return nullptr;
+        }
+
+        if (it->second.expires <= ServerInstance->Time())
+        {
+            misses++;
+            Erase(it);
+            return nullptr;
+        }
+
+        hits++;
+        return &it->second.info;
+    }
+
+    bool Contains(const std::string& ip) const
+    {
+        return entries.find(ip) != entries.end();
+    }
+
+    // Adds an entry to the cache and returns the time at which it expires.
+    time_t Add(const std::string& ip, const std::string& info, time_t expires = 0)
+    {
+        auto it = entries.find(ip);
+        if (it != entries.end())
+            Erase(it);
+
+        if (!expires)
+            expires = ServerInstance->Time() + static_cast<time_t>(ttl);
+
+        order.push_back(ip);
+        entries.emplace(ip, Entry { info, expires, std::prev(order.end()) });
+        while (entries.size() > maxentries)
+            Erase(entries.find(order.front()));
+        return expires;
+    }
+
+    // Calls the specified function for every unexpired entry.
+    void ForEach(const std::function<void(const std::string&, const std::string&, time_t)>& func) const
+    {
+        for (const auto& ip : order)
+        {
+            const auto& entry = entries.find(ip)->second;
+            if (entry.expires > ServerInstance->Time())
+                func(ip, entry.info, entry.expires);
+        }
+    }
+
+    size_t GetSize() const
+    {
+        return entries.size();
+    }
+};
+
+// An entry which has been read from or is about to be written to disk.
+struct StoredEntry final
+{
+    std::string ip;
+    std::string info;
+    time_t expires;
+};
+
+// Stores the IP information cache on disk so it survives restarts. The file
+// is made up of "<expiry> <ip> <info>" lines which are only ever appended to
+// and the last line for an IP address is the one which is used.
+class IPInfoStore final
+{
+private:
+    // The path to the cache file.
+    std::string path;
+
+    // The stream which new entries are appended to.
+    std::ofstream stream;
+
+    // Entries which are being read from the cache file in the background.
+    std::future<std::vector<StoredEntry>> loading;
+
+    // The compaction which is running in the background.
+    std::future<std::string> compacting;
+
+    // Lines which were appended while the cache file was being compacted.
+    std::vector<std::string> pending;
+
+    // The time at which the cache file should next be compacted.
+    time_t nextcompact = 0;
+
+    static std::string FormatLine(const std::string& ip, const std::string& info, time_t expires)
+    {
+        std::string line = INSP_FORMAT("{} {} {}", expires, ip, info);
+        std::replace_if(line.begin(), line.end(), [](char chr) { return chr == '\r' || chr == '\n'; }, ' ');
+        return line;
+    }
+
+    // Parses a line from the cache file. Returns false if it is not a complete record.
+    static bool ParseLine(const std::string& line, StoredEntry& entry)
+    {
+        const size_t ipstart = line.find(' ');
+        const size_t infostart = ipstart == std::string::npos ? ipstart : line.find(' ', ipstart + 1);
+        if (!ipstart || infostart == std::string::npos || infostart + 1 >= line.length())
+            return false;
+
+        const std::string expires = line.substr(0, ipstart);
+        if (expires.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        irc::sockets::sockaddrs sa;
+        entry.ip = line.substr(ipstart + 1, infostart - ipstart - 1);
+        if (!irc::sockets::aptosa(entry.ip, 0, sa))
+            return false;
+
+        entry.expires = ConvToNum<time_t>(expires);
+        entry.info = line.substr(infostart + 1);
+        return true;
+    }
+
+    // Reads the first size bytes of the cache file. Anything after that was
+    // appended after loading started and is already in the memory cache.
+    static std::vector<StoredEntry> Read(const std::string& file, std::uintmax_t size)
+    {
+        std::string contents(size, '\0');
+        std::ifstream input(file, std::ios::binary);
+        input.read(contents.data(), contents.size());
+        contents.resize(input.gcount());
+
+        std::unordered_map<std::string, StoredEntry> latest;
+        const time_t now = time(nullptr);
+        for (size_t linestart = 0; linestart < contents.length(); )
+        {
+            // A line without a terminator was still being written.
+            const size_t lineend = contents.find('\n', linestart);
+            if (lineend == std::string::npos)
+                break;
+
+            const std::string line = contents.substr(linestart, lineend - linestart);
+            linestart = lineend + 1;
+
+            StoredEntry entry;
+            if (!ParseLine(line, entry))
+                continue; // Malformed or truncated line.
+
+            if (entry.expires > now)
+                latest[entry.ip] = std::move(entry);
+            else
+                latest.erase(entry.ip);
+        }
+
+        std::vector<StoredEntry> entries;
+        entries.reserve(latest.size());
+        for (auto& [_, entry] : latest)
+            entries.push_back(std::move(entry));
+        return entries;
+    }
+
+    static std::string Write(const std::string& file, const std::vector<StoredEntry>& entries)
+    {
+        const std::string tempfile = file + ".tmp";
+        std::ofstream output(tempfile, std::ios::trunc);
+        for (const auto& entry : entries)
+            output << FormatLine(entry.ip, entry.info, entry.expires) << '\n';
+
+        output.close();
+        if (output.fail())
+            return "Unable to write " + tempfile;
+
+        std::error_code ec;
+        std::filesystem::rename(tempfile, file, ec);
+        if (ec)
+            return INSP_FORMAT("Unable to replace {}: {}", file, ec.message());
+
+        return {};
     }
 
 public:
-    IPInfoResolver(Module* Creator, User* user, StringExtItem& cache, const std::string& key)
-        : Thread(), cachedinfo(cache), apikey(key), theiruuid(user->uuid), resolved_user(user)
+    // The interval at which the cache file is compacted.
+    unsigned long compactinterval;
+
+    ~IPInfoStore()
+    {
+        if (compacting.valid())
+            compacting.wait();
+    }
+
+    // Opens the cache file and starts reading it in the background.
+    void Open(const std::string& newpath)
     {
-        if (user->client_sa.is_ip())
+        if (newpath == path)
+            return;
+
+        if (compacting.valid())
+            compacting.wait();
+        compacting = {};
+        pending.clear();
+
+        path = newpath;
+        stream.close();
+        stream.clear();
+
+        // If the last line was cut short (e.g. by a crash) then terminate it
+        // so that it does not run into the next line we append.
+        std::error_code ec;
+        std::uintmax_t size = std::filesystem::file_size(path, ec);
+        if (ec)
+            size = 0;
+        else if (size)
         {
-            this->Start();
+            std::ifstream input(path, std::ios::binary);
+            input.seekg(size - 1);
+            if (input.get() != '\n')
+            {
+                std::ofstream(path, std::ios::app) << '\n';
+                size++;
+            }
         }
+
+        stream.open(path, std::ios::app);
+        loading = std::async(std::launch::async, Read, path, size);
+        nextcompact = ServerInstance->Time() + compactinterval;
+    }
+
+    void Append(const std::string& ip, const std::string& info, time_t expires)
+    {
+        const std::string line = FormatLine(ip, info, expires);
+        if (compacting.valid())
+            pending.push_back(line);
+        else
+            stream << line << std::endl;
+    }
+
+    // Takes the entries which were read from the cache file if they are ready.
+    bool TakeLoaded(std::vector<StoredEntry>& entries)
+    {
+        if (!loading.valid() || loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+
+        entries = loading.get();
+        return true;
+    }
+
+    bool IsLoaded() const
+    {
+        return !loading.valid();
+    }
+
+    // Starts compacting the cache file in the background if it is due.
+    void Compact(const IPInfoCache& cache, time_t now)
+    {
+        if (path.empty() || !IsLoaded() || compacting.valid() || now < nextcompact)
+            return;
+
+        std::vector<StoredEntry> entries;
+        entries.reserve(cache.GetSize());
+        cache.ForEach([&entries](const std::string& ip, const std::string& info, time_t expires) {
+            entries.push_back({ ip, info, expires });
+        });
+
+        compacting = std::async(std::launch::async, Write, path, std::move(entries));
+        nextcompact = now + compactinterval;
+    }
+
+    // Finishes a compaction if one has completed. Returns an error message on failure.
+    std::string FinishCompact()
+    {
+        if (!compacting.valid() || compacting.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return {};
+
+        const std::string error = compacting.get();
+
+        // The file may have been replaced so we need to reopen it.
+        stream.close();
+        stream.clear();
+        stream.open(path, std::ios::app);
+        for (const auto& line : pending)
+            stream << line << '\n';
+        stream.flush();
+        pending.clear();
+        return error;
+    }
+};
+
+class IPInfoTimer final
+    : public Timer
+{
+private:
+    std::function<void()> callback;
+
+public:
+    IPInfoTimer(std::function<void()> cb)
+        : Timer(1, true)
+        , callback(std::move(cb))
+    {
+    }
+
+    bool Tick() override
+    {
+        callback();
+        return true;
     }
 };
 
-class ModuleIPInfo : public Module, public Whois::EventListener
+class ModuleIPInfo : public Module, public Stats::EventListener, public Whois::EventListener
 {
 private:
     StringExtItem cachedinfo;
     std::string apikey;
+    IPInfoPool pool;
+    IPInfoCache cache;
+    IPInfoStore store;
+    char statschar;
+    IPInfoTimer timer;
+    std::string currentpoolsettings;
+
+    // The users waiting for an IP address lookup. The first UUID is the user
+    // being looked up and the second is the oper who is waiting for it.
+    std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>> inflight;
+
+    // The ranges which are not looked up because they are not publicly routable.
+    std::vector<irc::sockets::cidr_mask> privateranges;
 
-    bool IsPrivateIP(const std::string& ip)
+    bool IsPrivateIP(const irc::sockets::sockaddrs& sa)
     {
-        // Regex patterns for private IPv4 addresses
-        std::regex private_ipv4_patterns[] = {
-            std::regex("^10\\..*"),
-            std::regex("^172\\.(1[6-9]|2[0-9]|3[0-1])\\..*"),
-            std::regex("^192\\.168\\..*")
-        };
+        // IPv4-mapped IPv6 addresses are checked against the IPv4 ranges.
+        if (sa.family() == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sa.in6.sin6_addr))
+        {
+            irc::sockets::sockaddrs mapped;
+            mapped.in4.sin_family = AF_INET;
+            memcpy(&mapped.in4.sin_addr, sa.in6.sin6_addr.s6_addr + 12, sizeof(mapped.in4.sin_addr));
+            return IsPrivateIP(mapped);
+        }
 
-        // Check IPv4 addresses
-        for (const auto& pattern : private_ipv4_patterns)
+        for (const auto& range : privateranges)
         {
-            if (std::regex_match(ip, pattern))
+            if (range.match(sa))
                 return true;
         }
+        return false;
+    }
+
+    void HandleResults()
+    {
+        for (const auto& result : pool.TakeResults())
+        {
+            if (result.info.empty())
+                ServerInstance->SNO.WriteGlobalSno('a', "IPInfo: Failed to get data for {}: {}", result.ip, result.error);
+            else
+                store.Append(result.ip, result.info, cache.Add(result.ip, result.info));
+
+            auto it = inflight.find(result.ip);
+            if (it == inflight.end())
+                continue;
 
-        // Check IPv6 link-local addresses (fe80::/10)
-        if (ip.find("fe80:") == 0)
-            return true;
+            for (const auto& [targetuuid, sourceuuid] : it->second)
+            {
+                auto* target = ServerInstance->Users.FindUUID(targetuuid);
+                if (!target || target->client_sa.addr() != result.ip || result.info.empty())
+                    continue;
 
-        // Check loopback addresses
-        if (ip == "127.0.0.1" || ip == "::1")
-            return true;
+                cachedinfo.Set(target, result.info);
 
-        return false;
+                auto* source = ServerInstance->Users.FindUUID(sourceuuid);
+                if (source)
+                    source->WriteNumeric(RPL_WHOISSPECIAL, target->nick, "ip info: " + result.info);
+            }
+            inflight.erase(it);
+        }
     }
 
 public:
     ModuleIPInfo()
         : Module(VF_NONE, "Adds IPinfo.io information to WHOIS responses for opers, using a configured API key.")
+        , Stats::EventListener(this)
         , Whois::EventListener(this)
         , cachedinfo(this, "ipinfo", ExtensionType::USER, true) // Enable synchronization across the network
+        , timer([this] { HandleResults(); })
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+    }
+
+    ~ModuleIPInfo() override
+    {
+        pool.Stop();
+        curl_global_cleanup();
+    }
+
+    void init() override
     {
+        ServerInstance->Timers.AddTimer(&timer);
     }
 
     void ReadConfig(ConfigStatus& status) override
@@ -164,6 +714,50 @@ public:
             throw ModuleException(this, "<ipinfo:apikey> No APIKEY? This is a required configuration option.");
         }
 
+        cache.maxentries = tag->getNum<size_t>("cachesize", 10000);
+        cache.ttl = tag->getDuration("cachettl", 24*60*60);
+        pool.maxqueue = tag->getNum<size_t>("maxqueue", 1000, 1);
+        statschar = tag->getCharacter("statschar", 'W');
+        store.compactinterval = tag->getDuration("compactinterval", 60*60, 60);
+        store.Open(ServerInstance->Config->Paths.PrependData(tag->getString("cachefile", "ipinfo.db", 1)));
+
+        std::vector<irc::sockets::cidr_mask> newprivateranges;
+        irc::spacesepstream rangestream("10.0.0.0/8 172.16.0.0/12 192.168.0.0/16 100.64.0.0/10 127.0.0.0/8 169.254.0.0/16 ::1/128 fe80::/10 fc00::/7 "
+            + tag->getString("privateranges"));
+        for (std::string range; rangestream.GetToken(range); )
+        {
+            irc::sockets::sockaddrs addr;
+            const size_t slash = range.find('/');
+            if (slash == std::string::npos || !irc::sockets::aptosa(range.substr(0, slash), 0, addr))
+                throw ModuleException(this, "<ipinfo:privateranges> contains an invalid CIDR range: " + range);
+
+            // The prefix length has to be a number which is valid for the address family.
+            const std::string prefix = range.substr(slash + 1);
+            const unsigned int maxlength = addr.family() == AF_INET ? 32 : 128;
+            if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos
+                || ConvToNum<unsigned int>(prefix) > maxlength)
+                throw ModuleException(this, INSP_FORMAT("<ipinfo:privateranges> contains a CIDR range with an invalid prefix length: {} (must be between 0 and {})",
+                    range, maxlength));
+
+            newprivateranges.emplace_back(addr, static_cast<unsigned char>(ConvToNum<unsigned int>(prefix)));
+        }
+        privateranges.swap(newprivateranges);
+
+        // Only restart the workers if their settings have changed. The old
+        // workers finish their current lookup in the background and hand the
+        // result back as normal so nothing waits on them here.
+        const size_t threads = tag->getNum<size_t>("threads", 4, 1, 64);
+        const long timeout = tag->getDuration("timeout", 10, 1);
+        std::string baseurl = tag->getString("baseurl", "https://ipinfo.io/", 1);
+        if (baseurl.back() != '/')
+            baseurl.push_back('/');
+        const std::string poolsettings = INSP_FORMAT("{} {} {} {}", threads, timeout, baseurl, apikey);
+        if (poolsettings != currentpoolsettings)
+        {
+            pool.Start(threads, baseurl, apikey, timeout);
+            currentpoolsettings = poolsettings;
+        }
+
         const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
         for (const auto& user : users)
         {
@@ -171,6 +765,37 @@ public:
         }
     }
 
+    void OnBackgroundTimer(time_t now) override
+    {
+        std::vector<StoredEntry> entries;
+        if (store.TakeLoaded(entries))
+        {
+            // Anything looked up since we started is newer than what's on disk.
+            for (const auto& entry : entries)
+            {
+                if (!cache.Contains(entry.ip))
+                    cache.Add(entry.ip, entry.info, entry.expires);
+            }
+            ServerInstance->Logs.Debug(MODNAME, "Loaded {} cached IP addresses from disk", entries.size());
+        }
+
+        const std::string error = store.FinishCompact();
+        if (!error.empty())
+            ServerInstance->SNO.WriteGlobalSno('a', "IPInfo: Failed to compact the cache file: {}", error);
+
+        store.Compact(cache, now);
+    }
+
+    ModResult OnStats(Stats::Context& stats) override
+    {
+        if (stats.GetSymbol() != statschar)
+            return MOD_RES_PASSTHRU;
+
+        stats.AddGenericRow(INSP_FORMAT("IPInfo: {} cached IP addresses, {} cache hits, {} cache misses",
+            cache.GetSize(), cache.hits, cache.misses));
+        return MOD_RES_DENY;
+    }
+
     void OnWhois(Whois::Context& whois) override
     {
         User* target = whois.GetTarget();
@@ -192,7 +817,7 @@ public:
         }
 
         // Check for private IP addresses
-        if (IsPrivateIP(target->client_sa.addr()))
+        if (IsPrivateIP(target->client_sa))
         {
             whois.SendLine(RPL_WHOISSPECIAL, "ip info: user is connecting from a private IP address.");
             return;
@@ -202,11 +827,36 @@ public:
         if (cached)
         {
             whois.SendLine(RPL_WHOISSPECIAL, "ip info (cached): " + *cached);
+            return;
         }
-        else
+
+        const std::string ip = target->client_sa.addr();
+        cached = cache.Find(ip);
+        if (cached)
         {
-            new IPInfoResolver(this, target, cachedinfo, apikey);
+            cachedinfo.Set(target, *cached);
+            whois.SendLine(RPL_WHOISSPECIAL, "ip info (cached): " + *cached);
+            return;
+        }
+
+        // If this IP is already being looked up then wait for that lookup.
+        auto it = inflight.find(ip);
+        if (it == inflight.end())
+        {
+            if (!pool.Enqueue(ip))
+            {
+                whois.SendLine(RPL_WHOISSPECIAL, "ip info: too many lookups in progress, try again later.");
+                return;
+            }
+            it = inflight.emplace(ip, std::vector<std::pair<std::string, std::string>>()).first;
         }
+
+        // Repeating the WHOIS while the lookup is in progress should not
+        // result in the reply being sent more than once.
+        const auto waiter = std::make_pair(target->uuid, whois.GetSource()->uuid);
+        if (std::find(it->second.begin(), it->second.end(), waiter) == it->second.end())
+            it->second.push_back(waiter);
+        whois.SendLine(RPL_WHOISSPECIAL, "ip info: lookup in progress.");
     }
 };
 
@@ -34,6 +34,7 @@
 
 #include "inspircd.h"
 #include "modules/account.h"
+#include "modules/away.h"
 
 static Account::API* g_accountapi = nullptr;
 
@@ -81,7 +82,8 @@ struct IdleProfile
 	{
 	}
 
-	bool Matches(LocalUser* lu) const
+	/** Checks every condition other than the idle time itself. */
+	bool CanKill(LocalUser* lu) const
 	{
 		if (!lu->IsFullyConnected())
 			return false;
@@ -110,43 +112,210 @@ struct IdleProfile
 				break;
 		}
 
-		if (GetIdle(lu) < mintime)
-			return false;
-
 		return true;
 	}
 };
 
 typedef std::map<std::string, IdleProfile> ProfileMap;
 
+/** A hierarchical timer wheel of idle deadlines. Each level has 64 slots and
+ * each slot on a level covers 64 times as many seconds as one on the level
+ * below it. Entries are cascaded down a level as their slot comes up so that
+ * advancing the wheel only touches the entries which are about to expire.
+ */
+class DeadlineWheel final
+{
+public:
+	struct Entry final
+	{
+		/** The UUID of the user this deadline belongs to. */
+		std::string uuid;
+
+		/** The time at which the user will have been idle for long enough. */
+		time_t deadline;
+	};
+
+	typedef std::vector<Entry> Slot;
+
+private:
+	static constexpr unsigned int SLOT_BITS = 6;
+	static constexpr time_t SLOT_COUNT = 1 << SLOT_BITS;
+	static constexpr time_t SLOT_MASK = SLOT_COUNT - 1;
+	static constexpr unsigned int LEVEL_COUNT = 4;
+
+	/** The slots of each level of the wheel. */
+	std::array<std::array<Slot, SLOT_COUNT>, LEVEL_COUNT> levels;
+
+	/** The last time that the wheel was advanced to. */
+	time_t current;
+
+	void Place(Entry&& entry)
+	{
+		// Deadlines which have already passed are expired on the next tick.
+		time_t when = std::max(entry.deadline, current + 1);
+		for (unsigned int level = 0; level < LEVEL_COUNT; ++level)
+		{
+			const unsigned int shift = SLOT_BITS * level;
+			const time_t span = time_t(1) << (shift + SLOT_BITS);
+			if (when - current < span || level + 1 == LEVEL_COUNT)
+			{
+				// Deadlines past the end of the wheel are parked in the
+				// furthest top level slot and placed again when it cascades.
+				when = std::min(when, current + span - 1);
+				levels[level][(when >> shift) & SLOT_MASK].push_back(std::move(entry));
+				return;
+			}
+		}
+	}
+
+	void Cascade(unsigned int level)
+	{
+		Slot& slot = levels[level][(current >> (SLOT_BITS * level)) & SLOT_MASK];
+		if (slot.empty())
+			return;
+
+		Slot entries;
+		entries.swap(slot);
+		for (auto& entry : entries)
+			Place(std::move(entry));
+	}
+
+public:
+	DeadlineWheel()
+		: current(ServerInstance->Time())
+	{
+	}
+
+	void Add(const std::string& uuid, time_t deadline)
+	{
+		Place({ uuid, deadline });
+	}
+
+	void Clear()
+	{
+		for (auto& level : levels)
+			for (auto& slot : level)
+				slot.clear();
+	}
+
+	/** Advances the wheel to the specified time and returns the expired entries. */
+	Slot Advance(time_t now)
+	{
+		Slot expired;
+		while (current < now)
+		{
+			current++;
+
+			// Bring the entries from the upper levels down when the slots below
+			// them wrap around.
+			for (unsigned int level = 1; level < LEVEL_COUNT; ++level)
+			{
+				if ((current >> (SLOT_BITS * (level - 1))) & SLOT_MASK)
+					break;
+				Cascade(level);
+			}
+
+			Slot& slot = levels[0][current & SLOT_MASK];
+			for (auto& entry : slot)
+				expired.push_back(std::move(entry));
+			slot.clear();
+		}
+		return expired;
+	}
+};
+
 class ModuleKillIdle final
 	: public Module
+	, public Account::EventListener
+	, public Away::EventListener
 {
 private:
 	Account::API accountapi;
 	ProfileMap profiles;
 
-	IdleProfile* GetProfile(LocalUser* user)
+	/** The idle profile of each connect class, keyed by the class name. */
+	std::unordered_map<std::string, const IdleProfile*> classprofiles;
+
+	/** The deadline each user is currently scheduled for in the wheel. */
+	IntExtItem deadlineext;
+
+	DeadlineWheel wheel;
+
+	const IdleProfile* GetProfile(LocalUser* user)
 	{
 		const auto& cls = user->GetClass();
 		if (!cls)
-			return NULL;
+			return nullptr;
 
-		std::string name = cls->config->getString("idleprofile");
-		if (name.empty())
-			return NULL;
+		auto it = classprofiles.find(cls->GetName());
+		if (it == classprofiles.end())
+			return nullptr;
 
-		ProfileMap::iterator it = profiles.find(name);
-		if (it == profiles.end())
-			return NULL;
+		return it->second;
+	}
+
+	/** (Re)schedules the idle deadline of a user based on their last message. */
+	void Schedule(User* user)
+	{
+		LocalUser* lu = IS_LOCAL(user);
+		if (!lu || lu->quitting)
+			return;
 
-		return &it->second;
+		const IdleProfile* profile = GetProfile(lu);
+		if (!profile)
+		{
+			deadlineext.Unset(lu);
+			return;
+		}
+
+		const time_t deadline = lu->idle_lastmsg + profile->mintime;
+		if (deadlineext.Get(lu) == deadline)
+			return; // Already scheduled.
+
+		// Any entry for an older deadline is left in the wheel and discarded
+		// when it expires as it no longer matches the stored deadline.
+		deadlineext.Set(lu, deadline);
+		wheel.Add(lu->uuid, deadline);
+	}
+
+	void Expire(const DeadlineWheel::Entry& entry)
+	{
+		LocalUser* lu = IS_LOCAL(ServerInstance->Users.FindUUID(entry.uuid));
+		if (!lu || lu->quitting || deadlineext.Get(lu) != entry.deadline)
+			return; // User is gone or the entry is stale.
+
+		const IdleProfile* profile = GetProfile(lu);
+		if (!profile)
+		{
+			deadlineext.Unset(lu);
+			return;
+		}
+
+		// The user has spoken since this deadline was set.
+		if (GetIdle(lu) < profile->mintime)
+		{
+			Schedule(lu);
+			return;
+		}
+
+		if (profile->CanKill(lu))
+		{
+			ServerInstance->Users.QuitUser(lu, profile->reason);
+			return;
+		}
+
+		// The user is idle but exempt for now. They are scheduled again when
+		// one of the other conditions changes.
+		deadlineext.Unset(lu);
 	}
 
 public:
 	ModuleKillIdle()
 		: Module(VF_NONE, "Disconnect idle users matching configured conditions")
+		, Account::EventListener(this)
+		, Away::EventListener(this)
 		, accountapi(this)
+		, deadlineext(this, "kill-idle-deadline", ExtensionType::USER)
 	{
 		g_accountapi = &accountapi;
 	}
@@ -176,22 +345,67 @@ public:
 				{ "none", IdleProfile::AWAY_NONE },
 			});
 		}
+		std::unordered_map<std::string, const IdleProfile*> newclassprofiles;
+		for (const auto& cls : ServerInstance->Config->Classes)
+		{
+			ProfileMap::const_iterator it = newprofiles.find(cls->config->getString("idleprofile"));
+			if (it != newprofiles.end())
+				newclassprofiles[cls->GetName()] = &it->second;
+		}
+
 		profiles.swap(newprofiles);
-	}
+		classprofiles.swap(newclassprofiles);
 
-	void OnBackgroundTimer(time_t) override
-	{
-		UserManager::LocalList users = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator it = users.begin(); it != users.end();)
+		// The thresholds may have changed so schedule everyone from scratch.
+		wheel.Clear();
+		for (auto* lu : ServerInstance->Users.GetLocalUsers())
 		{
-			// The iterator may be invalidated by QuitUser()
-			LocalUser* u = *it;
-			++it;
-			IdleProfile* profile = GetProfile(u);
-			if (profile && profile->Matches(u))
-				ServerInstance->Users.QuitUser(u, profile->reason);
+			deadlineext.Unset(lu);
+			Schedule(lu);
 		}
 	}
+
+	void OnPostConnect(User* user) override
+	{
+		Schedule(user);
+	}
+
+	void OnUserPart(Membership* memb, std::string& partmessage, CUList& except_list) override
+	{
+		Schedule(memb->user);
+	}
+
+	void OnUserKick(User* source, Membership* memb, const std::string& reason, CUList& except_list) override
+	{
+		Schedule(memb->user);
+	}
+
+	void OnUserAway(User* user, const std::optional<AwayState>& prevstate) override
+	{
+		Schedule(user);
+	}
+
+	void OnUserBack(User* user, const std::optional<AwayState>& prevstate) override
+	{
+		Schedule(user);
+	}
+
+	void OnAccountChange(User* user, const std::string& newaccount) override
+	{
+		Schedule(user);
+	}
+
+	void OnPostOperLogout(User* user, const std::shared_ptr<OperAccount>& oper) override
+	{
+		Schedule(user);
+	}
+
+	void OnBackgroundTimer(time_t curtime) override
+	{
+		// QuitUser() does not remove users from the wheel so this is safe.
+		for (const auto& entry : wheel.Advance(curtime))
+			Expire(entry);
+	}
 };
 
 MODULE_INIT(ModuleKillIdle)
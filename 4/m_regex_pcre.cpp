@@ -23,6 +23,7 @@
  */
 
 /// $ModAuthor: InspIRCd Developers
+/// $ModConfig: <pcre statschar="x" top="10">
 /// $ModDepends: core 4
 /// $ModDesc: Provides the pcre regular expression engine which uses the PCRE library.
 /// $ModLink: https://docs.inspircd.org/4/moved-modules/#regex_pcre
@@ -38,6 +39,7 @@
 
 #include "inspircd.h"
 #include "modules/regex.h"
+#include "modules/stats.h"
 
 #include <pcre.h>
 
@@ -45,6 +47,11 @@
 # pragma comment(lib, "pcre.lib")
 #endif
 
+class PCREPattern;
+
+// Holds the patterns which currently exist so their costs can be listed.
+static std::unordered_set<PCREPattern*> patterns;
+
 class PCREPattern final
 	: public Regex::Pattern
 {
@@ -52,6 +59,18 @@ class PCREPattern final
 	pcre* regex;
 
  public:
+	// The number of times this pattern has been matched against some text.
+	unsigned long matches = 0;
+
+	// The number of times this pattern has matched the text it was given.
+	unsigned long hits = 0;
+
+	// The total time spent matching this pattern.
+	std::chrono::steady_clock::duration totaltime { };
+
+	// The longest time a single match of this pattern has taken.
+	std::chrono::steady_clock::duration peaktime { };
+
 	PCREPattern(const Module* mod, const std::string& pattern, uint8_t options)
 		: Regex::Pattern(pattern, options)
 	{
@@ -64,17 +83,30 @@ class PCREPattern final
 		regex = pcre_compile(pattern.c_str(), flags, &error, &erroroffset, nullptr);
 		if (!regex)
 			throw Regex::Exception(mod, pattern, error, erroroffset);
+
+		patterns.insert(this);
 	}
 
 	~PCREPattern() override
 	{
+		patterns.erase(this);
 		pcre_free(regex);
 	}
 
 	bool IsMatch(const std::string& text) override
 	{
+		const auto start = std::chrono::steady_clock::now();
+
 		// This cast is potentially unsafe but it's what pcre_exec expects.
-		return pcre_exec(regex, nullptr, text.c_str(), int(text.length()), 0, 0, nullptr, 0) >= 0;
+		const bool matched = pcre_exec(regex, nullptr, text.c_str(), int(text.length()), 0, 0, nullptr, 0) >= 0;
+
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		matches++;
+		if (matched)
+			hits++;
+		totaltime += elapsed;
+		peaktime = std::max(peaktime, elapsed);
+		return matched;
 	}
 
 	std::optional<Regex::MatchCollection> Matches(const std::string& text) override
@@ -90,17 +122,101 @@ class PCREPattern final
 	}
 };
 
+static std::string DurationToMicroseconds(std::chrono::steady_clock::duration duration)
+{
+	return ConvToStr(std::chrono::duration_cast<std::chrono::microseconds>(duration).count()) + "us";
+}
+
+static std::vector<const PCREPattern*> GetMostExpensive(size_t count)
+{
+	std::vector<const PCREPattern*> sorted(patterns.begin(), patterns.end());
+	count = std::min(count, sorted.size());
+	std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), [](const PCREPattern* lhs, const PCREPattern* rhs) {
+		return lhs->totaltime > rhs->totaltime;
+	});
+	sorted.resize(count);
+	return sorted;
+}
+
+class CommandPCREStats final
+	: public SplitCommand
+{
+ public:
+	size_t defaultcount;
+
+	CommandPCREStats(Module* Creator)
+		: SplitCommand(Creator, "PCRESTATS")
+	{
+		access_needed = CmdAccess::OPERATOR;
+		syntax = { "[<count>]" };
+	}
+
+	CmdResult HandleLocal(LocalUser* user, const Params& parameters) override
+	{
+		size_t count = defaultcount;
+		if (!parameters.empty())
+		{
+			count = ConvToNum<size_t>(parameters[0]);
+			if (!count)
+			{
+				user->WriteNotice("*** PCRESTATS: Invalid pattern count: " + parameters[0]);
+				return CmdResult::FAILURE;
+			}
+		}
+
+		const auto expensive = GetMostExpensive(count);
+		user->WriteNotice(INSP_FORMAT("*** PCRESTATS: Showing the {} most expensive of {} patterns",
+			expensive.size(), patterns.size()));
+
+		for (const auto* pattern : expensive)
+		{
+			user->WriteNotice(INSP_FORMAT("*** PCRESTATS: {}: {} matches, {} hits, {} total, {} peak",
+				pattern->GetPattern(), pattern->matches, pattern->hits,
+				DurationToMicroseconds(pattern->totaltime), DurationToMicroseconds(pattern->peaktime)));
+		}
+
+		user->WriteNotice("*** PCRESTATS: End of list");
+		return CmdResult::SUCCESS;
+	}
+};
+
 class ModuleRegexPCRE final
 	: public Module
+	, public Stats::EventListener
 {
  private:
 	Regex::SimpleEngine<PCREPattern> regex;
+	CommandPCREStats cmd;
+	char statschar;
 
  public:
 	ModuleRegexPCRE()
 		: Module(VF_NONE, "Provides the pcre regular expression engine which uses the PCRE library.")
+		, Stats::EventListener(this)
 		, regex(this, "pcre")
+		, cmd(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) override
+	{
+		const auto& tag = ServerInstance->Config->ConfValue("pcre");
+		statschar = tag->getCharacter("statschar", 'x');
+		cmd.defaultcount = tag->getNum<size_t>("top", 10, 1);
+	}
+
+	ModResult OnStats(Stats::Context& stats) override
 	{
+		if (stats.GetSymbol() != statschar)
+			return MOD_RES_PASSTHRU;
+
+		for (const auto* pattern : GetMostExpensive(cmd.defaultcount))
+		{
+			stats.AddGenericRow(INSP_FORMAT("{}: {} matches, {} hits, {} total, {} peak",
+				pattern->GetPattern(), pattern->matches, pattern->hits,
+				DurationToMicroseconds(pattern->totaltime), DurationToMicroseconds(pattern->peaktime)));
+		}
+		return MOD_RES_DENY;
 	}
 };
 
@@ -34,6 +34,233 @@ static bool isLoggedIn(const User* user)
 	return *g_accountapi && (*g_accountapi)->GetAccountName(user);
 }
 
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
+{
+private:
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
+	{
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+class GALine;
+
+/** Indexes the A-lines or GA-lines by their host mask so that a connecting user
+ * only has to be checked against the lines which can possibly match them.
+ */
+class AuthLineIndex
+{
+ private:
+	/** Lines with an IP address or CIDR range host mask. */
+	CIDRTree<GALine*> cidrs;
+
+	/** Lines with a host mask that contains no wildcards. */
+	std::unordered_map<std::string, std::vector<GALine*>, irc::insensitive, irc::StrHashComp> literals;
+	size_t literalcount = 0;
+
+	/** Lines which have to be checked against every user. */
+	std::vector<GALine*> wildcards;
+
+	/** Determines whether a host mask has to be checked against every user. */
+	static bool IsWildcard(const std::string& hostmask)
+	{
+		if (hostmask.empty() || hostmask.find_first_of("*?") != std::string::npos)
+			return true;
+
+		// MatchCIDR is laxer about prefix lengths than we are.
+		irc::sockets::cidr_mask range;
+		irc::sockets::sockaddrs sa;
+		const auto slashpos = hostmask.find('/');
+		return slashpos != std::string::npos && !CIDRTree<GALine*>::ParseRange(hostmask, range)
+			&& irc::sockets::aptosa(hostmask.substr(0, slashpos), 0, sa);
+	}
+
+	static void RemoveFrom(std::vector<GALine*>& lines, GALine* line)
+	{
+		auto it = std::find(lines.begin(), lines.end(), line);
+		if (it != lines.end())
+			lines.erase(it);
+	}
+
+	void FindHost(const std::string& host, std::vector<GALine*>& lines) const;
+	static GALine* FindIn(const std::vector<GALine*>& lines, User* user);
+
+ public:
+	void Add(GALine* line);
+	void Remove(GALine* line);
+	GALine* Find(User* user) const;
+
+	void GetStats(size_t& cidr, size_t& literal, size_t& wildcard) const
+	{
+		cidr = cidrs.GetSize();
+		literal = literalcount;
+		wildcard = wildcards.size();
+	}
+};
+
 class GALine : public XLine
 {
  protected:
@@ -46,12 +273,31 @@ class GALine : public XLine
 
 	std::string matchtext;
 
+	/** The index this line is stored in. */
+	AuthLineIndex& index;
+
  public:
-	GALine(time_t s_time, long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host, std::string othertext = "GA")
-		: XLine(s_time, d, src, re, othertext), identmask(ident), hostmask(host)
+	GALine(AuthLineIndex& idx, time_t s_time, long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host, std::string othertext = "GA")
+		: XLine(s_time, d, src, re, othertext), identmask(ident), hostmask(host), index(idx)
 	{
 		matchtext = identmask;
 		matchtext.append("@").append(this->hostmask);
+		index.Add(this);
+	}
+
+	~GALine() override
+	{
+		index.Remove(this);
+	}
+
+	const std::string& GetHostMask() const
+	{
+		return hostmask;
+	}
+
+	bool IsExpired() const
+	{
+		return duration && ServerInstance->Time() > expiry;
 	}
 
 	void Apply(User* u) override
@@ -97,11 +343,93 @@ class GALine : public XLine
 	}
 };
 
+void AuthLineIndex::Add(GALine* line)
+{
+	const std::string& hostmask = line->GetHostMask();
+	if (IsWildcard(hostmask))
+	{
+		wildcards.push_back(line);
+		return;
+	}
+
+	// Lines with an IP address host mask are also stored as a literal in case
+	// the real host of the user is not their IP address.
+	irc::sockets::cidr_mask range;
+	if (CIDRTree<GALine*>::ParseRange(hostmask, range))
+		cidrs.Add(range, line);
+	else
+		literalcount++;
+	literals[hostmask].push_back(line);
+}
+
+void AuthLineIndex::Remove(GALine* line)
+{
+	const std::string& hostmask = line->GetHostMask();
+	if (IsWildcard(hostmask))
+	{
+		RemoveFrom(wildcards, line);
+		return;
+	}
+
+	irc::sockets::cidr_mask range;
+	if (CIDRTree<GALine*>::ParseRange(hostmask, range))
+		cidrs.Remove(range, line);
+	else
+		literalcount--;
+
+	auto it = literals.find(hostmask);
+	if (it != literals.end())
+	{
+		RemoveFrom(it->second, line);
+		if (it->second.empty())
+			literals.erase(it);
+	}
+}
+
+GALine* AuthLineIndex::FindIn(const std::vector<GALine*>& lines, User* user)
+{
+	for (auto* line : lines)
+	{
+		// Expired lines are left for the core to remove.
+		if (!line->IsExpired() && line->Matches(user))
+			return line;
+	}
+	return nullptr;
+}
+
+void AuthLineIndex::FindHost(const std::string& host, std::vector<GALine*>& lines) const
+{
+	auto it = literals.find(host);
+	if (it != literals.end())
+		lines.insert(lines.end(), it->second.begin(), it->second.end());
+
+	irc::sockets::sockaddrs sa;
+	if (irc::sockets::aptosa(host, 0, sa))
+		cidrs.Find(sa, lines);
+}
+
+GALine* AuthLineIndex::Find(User* user) const
+{
+	// The candidates are always confirmed with GALine::Matches so the result
+	// is the same as checking every line.
+	std::vector<GALine*> candidates;
+	cidrs.Find(user->client_sa, candidates);
+	FindHost(user->GetRealHost(), candidates);
+	if (user->GetAddress() != user->GetRealHost())
+		FindHost(user->GetAddress(), candidates);
+
+	GALine* line = FindIn(candidates, user);
+	if (line)
+		return line;
+
+	return FindIn(wildcards, user);
+}
+
 class ALine : public GALine
 {
  public:
-	ALine(time_t s_time, long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host)
-		: GALine(s_time, d, src, re, ident, host, "A") {}
+	ALine(AuthLineIndex& idx, time_t s_time, long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host)
+		: GALine(idx, s_time, d, src, re, ident, host, "A") {}
 
 	bool IsBurstable() override
 	{
@@ -112,6 +440,8 @@ class ALine : public GALine
 class ALineFactory : public XLineFactory
 {
  public:
+	AuthLineIndex index;
+
 	ALineFactory() : XLineFactory("A") { }
 
 	/** Generate an ALine
@@ -119,13 +449,15 @@ class ALineFactory : public XLineFactory
 	ALine* Generate(time_t set_time, unsigned long duration, const std::string& source, const std::string& reason, const std::string& xline_specific_mask) override
 	{
 		auto ih = ServerInstance->XLines->SplitUserHost(xline_specific_mask);
-		return new ALine(set_time, duration, source, reason, ih.first, ih.second);
+		return new ALine(index, set_time, duration, source, reason, ih.first, ih.second);
 	}
 };
 
 class GALineFactory : public XLineFactory
 {
  public:
+	AuthLineIndex index;
+
 	GALineFactory() : XLineFactory("GA") { }
 
 	/** Generate a GALine
@@ -133,7 +465,7 @@ class GALineFactory : public XLineFactory
 	GALine* Generate(time_t set_time, unsigned long duration, const std::string& source, const std::string& reason, const std::string& xline_specific_mask) override
 	{
 		auto ih = ServerInstance->XLines->SplitUserHost(xline_specific_mask);
-		return new GALine(set_time, duration, source, reason, ih.first, ih.second);
+		return new GALine(index, set_time, duration, source, reason, ih.first, ih.second);
 	}
 };
 
@@ -246,6 +578,14 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 	GALineFactory fact2;
 	Account::API accountapi;
 
+	static void SendIndexStats(Stats::Context& stats, const std::string& type, const AuthLineIndex& index)
+	{
+		size_t cidrs, literals, wildcards;
+		index.GetStats(cidrs, literals, wildcards);
+		stats.AddGenericRow(INSP_FORMAT("{}-line index: {} CIDR, {} literal, {} wildcard",
+			type, cidrs, literals, wildcards));
+	}
+
  public:
 	ModuleRequireAuth()
 		: Module(VF_COMMON, "Gives /ALINE and /GALINE, short for auth-lines. Users affected by these will have to use SASL to connect, while any users already connected but not identified to services will be disconnected in a similar manner to G-lines.")
@@ -269,11 +609,13 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 		if (stats.GetSymbol() == 'A')
 		{
 			ServerInstance->XLines->InvokeStats("GA", stats);
+			SendIndexStats(stats, "GA", fact2.index);
 			return MOD_RES_DENY;
 		}
 		else if (stats.GetSymbol() == 'a')
 		{
 			ServerInstance->XLines->InvokeStats("A", stats);
+			SendIndexStats(stats, "A", fact1.index);
 			return MOD_RES_DENY;
 		}
 		return MOD_RES_PASSTHRU;
@@ -292,8 +634,8 @@ class ModuleRequireAuth : public Module, public Stats::EventListener
 		/*I'm afraid that using the normal xline methods would then result in this line being checked at the wrong time.*/
 		if (!isLoggedIn(user))
 		{
-			XLine* locallines = ServerInstance->XLines->MatchesLine("A", user);
-			XLine* globallines = ServerInstance->XLines->MatchesLine("GA", user);
+			XLine* locallines = fact1.index.Find(user);
+			XLine* globallines = fact2.index.Find(user);
 			if (locallines)
 			{
 				user->WriteNotice("*** NOTICE -- You need to identify via SASL to use this server (your host is A-lined).");
@@ -22,22 +22,41 @@
  * - websocket/websocket-users: Requires the user to be connected over WebSocket.
  * - webirc/webirc-users: Requires the user to have authenticated via WEBIRC.
  *
+ * When the groups change on rehash the memberships of existing users are
+ * recalculated over several seconds to avoid stalling the server. This can be
+ * configured with:
+ *
+ *   <securitygroups rebuildtime="50" statschar="G">
+ *
+ * - rebuildtime: The number of milliseconds per second to spend recalculating.
+ * - statschar: The /STATS character which shows the recalculation progress.
+ *
  * Exposes:
  * - user extension "securitygroups" (comma-separated list, synced across the network)
  * - /SECURITYGROUPS [nick] command
+ *
+ * Once every server on the network advertises support for it, changes to the
+ * groups of a user are sent as "+name -name" deltas using the separate
+ * "securitygroups-delta" and "securitygroups-public-delta" metadata keys.
+ * Servers running an older version of this module only ever see full lists.
+ * When a server (re)loads this module the other servers resend the full lists
+ * of their users so it never applies deltas to groups it does not know about.
  */
 
 /// $ModAuthor: reverse - mike.chevronnet@gmail.com
 /// $ModDepends: core 4
 /// $ModDesc: Implements UnrealIRCd-style security-groups for InspIRCd 4.
 /// $ModConfig: <securitygroup name="example" mask="*@example.com" account="no" tls="no" insecure="no" websocket="no" webirc="no" public="yes">
+/// $ModConfig: <securitygroups rebuildtime="50" statschar="G">
 
 #include "inspircd.h"
 #include "extension.h"
 #include "numerichelper.h"
 #include "modules/account.h"
 #include "modules/extban.h"
+#include "modules/server.h"
 #include "modules/ssl.h"
+#include "modules/stats.h"
 #include "modules/webirc.h"
 #include "modules/whois.h"
 
@@ -47,14 +66,572 @@ typedef std::vector<std::string> MaskList;
 // A set of security group names.
 typedef insp::flat_set<std::string, irc::insensitive_swo> SecurityGroupList;
 
-static std::string FormatSecurityGroupList(const SecurityGroupList* list)
+// A set of security groups indexed by either their position in the group list
+// or their interned identifier.
+class GroupSet final
+{
+private:
+	std::vector<uint64_t> words;
+
+public:
+	bool Empty() const
+	{
+		for (const auto word : words)
+		{
+			if (word)
+				return false;
+		}
+		return true;
+	}
+
+	void Set(size_t idx)
+	{
+		if (idx / 64 >= words.size())
+			words.resize(idx / 64 + 1);
+		words[idx / 64] |= UINT64_C(1) << (idx % 64);
+	}
+
+	void Unset(size_t idx)
+	{
+		if (idx / 64 < words.size())
+			words[idx / 64] &= ~(UINT64_C(1) << (idx % 64));
+	}
+
+	bool Test(size_t idx) const
+	{
+		return idx / 64 < words.size() && (words[idx / 64] & (UINT64_C(1) << (idx % 64)));
+	}
+
+	GroupSet& operator|=(const GroupSet& other)
+	{
+		if (other.words.size() > words.size())
+			words.resize(other.words.size());
+		for (size_t idx = 0; idx < other.words.size(); ++idx)
+			words[idx] |= other.words[idx];
+		return *this;
+	}
+
+	GroupSet& operator&=(const GroupSet& other)
+	{
+		for (size_t idx = 0; idx < words.size(); ++idx)
+			words[idx] &= idx < other.words.size() ? other.words[idx] : 0;
+		return *this;
+	}
+
+	bool operator==(const GroupSet& other) const
+	{
+		const size_t longest = std::max(words.size(), other.words.size());
+		for (size_t idx = 0; idx < longest; ++idx)
+		{
+			const uint64_t word = idx < words.size() ? words[idx] : 0;
+			const uint64_t otherword = idx < other.words.size() ? other.words[idx] : 0;
+			if (word != otherword)
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const GroupSet& other) const
+	{
+		return !(*this == other);
+	}
+
+	template <typename Callback>
+	void ForEach(Callback&& callback) const
+	{
+		for (size_t idx = 0; idx < words.size(); ++idx)
+		{
+			if (!words[idx])
+				continue; // Skip empty words quickly.
+
+			for (size_t bit = 0; bit < 64; ++bit)
+			{
+				if (words[idx] & (UINT64_C(1) << bit))
+					callback(idx * 64 + bit);
+			}
+		}
+	}
+};
+
+// Interns security group names into small integer identifiers so that the
+// memberships of a user can be stored as a GroupSet.
+class GroupTable final
+{
+private:
+	std::unordered_map<std::string, size_t, irc::insensitive, irc::StrHashComp> ids;
+	std::vector<std::string> names;
+
+public:
+	size_t Intern(const std::string& name)
+	{
+		auto it = ids.find(name);
+		if (it != ids.end())
+			return it->second;
+
+		// Identifiers are never reused so that memberships calculated before a
+		// rehash stay valid after it.
+		names.push_back(name);
+		ids.emplace(name, names.size() - 1);
+		return names.size() - 1;
+	}
+
+	bool Find(const std::string& name, size_t& id) const
+	{
+		auto it = ids.find(name);
+		if (it == ids.end())
+			return false;
+
+		id = it->second;
+		return true;
+	}
+
+	const std::string& GetName(size_t id) const
+	{
+		return names[id];
+	}
+
+	SecurityGroupList GetNames(const GroupSet& groups) const
+	{
+		SecurityGroupList list;
+		groups.ForEach([this, &list](size_t id) { list.insert(names[id]); });
+		return list;
+	}
+
+	std::string Format(const GroupSet* groups, char sep) const
+	{
+		return (groups && !groups->Empty()) ? insp::join(GetNames(*groups), sep) : "none";
+	}
+};
+
+// Stores the security groups of a user as a GroupSet but syncs them over the
+// network as a space-separated list of names. When every server supports it
+// the changes to the groups of a user after they have been introduced are sent
+// as the added (+name) and removed (-name) groups using a separate key.
+class GroupSetExtItem final
+	: public SimpleExtItem<GroupSet>
+{
+private:
+	GroupTable& table;
+
+public:
+	// The metadata key that changes to the groups are sent with.
+	const std::string deltakey;
+
+	GroupSetExtItem(Module* Creator, const std::string& Key, GroupTable& groups)
+		: SimpleExtItem<GroupSet>(Creator, Key, ExtensionType::USER, true)
+		, table(groups)
+		, deltakey(Key + "-delta")
+	{
+	}
+
+	void FromInternal(Extensible* container, const std::string& value) noexcept override
+	{
+		GroupSet groups;
+		irc::spacesepstream groupstream(value);
+		for (std::string name; groupstream.GetToken(name); )
+			groups.Set(table.Intern(name));
+
+		if (groups.Empty())
+			Unset(container, false);
+		else
+			Set(container, groups, false);
+	}
+
+	// Applies changes to the groups of a user which were received from the network.
+	void FromDelta(User* user, const std::string& value)
+	{
+		GroupSet groups;
+		const GroupSet* oldgroups = Get(user);
+		if (oldgroups)
+			groups = *oldgroups;
+
+		irc::spacesepstream groupstream(value);
+		for (std::string name; groupstream.GetToken(name); )
+		{
+			if (name.length() > 1 && name[0] == '+')
+				groups.Set(table.Intern(name.substr(1)));
+			else if (name.length() > 1 && name[0] == '-')
+				groups.Unset(table.Intern(name.substr(1)));
+		}
+
+		if (groups.Empty())
+			Unset(user, false);
+		else
+			Set(user, groups, false);
+	}
+
+	std::string ToInternal(const Extensible* container, void* item) const noexcept override
+	{
+		return insp::join(table.GetNames(*static_cast<GroupSet*>(item)), ' ');
+	}
+
+	// Sets the groups of a local user and sends the changes to the network. If
+	// cansenddelta is false the full list is always sent.
+	void SetGroups(User* user, const GroupSet& groups, bool cansenddelta)
+	{
+		const GroupSet* oldgroups = Get(user);
+		if (groups.Empty())
+		{
+			if (oldgroups)
+				Unset(user);
+			return;
+		}
+
+		if (oldgroups && *oldgroups == groups)
+			return; // Nothing changed.
+
+		std::string delta;
+		if (oldgroups && cansenddelta)
+		{
+			groups.ForEach([this, &delta, oldgroups](size_t id) {
+				if (!oldgroups->Test(id))
+					delta.append(delta.empty() ? "+" : " +").append(table.GetName(id));
+			});
+			oldgroups->ForEach([this, &delta, &groups](size_t id) {
+				if (!groups.Test(id))
+					delta.append(delta.empty() ? "-" : " -").append(table.GetName(id));
+			});
+		}
+
+		// Fall back to the full list if the user had no groups or if the
+		// changes would be longer than it.
+		const std::string full = insp::join(table.GetNames(groups), ' ');
+		const bool senddelta = !delta.empty() && delta.length() < full.length();
+		Set(user, groups, false);
+		if (senddelta)
+			ServerInstance->PI->SendMetadata(user, deltakey, delta);
+		else
+			ServerInstance->PI->SendMetadata(user, name, full);
+	}
+
+	// Sends the full groups of a local user to the network.
+	void SendFull(User* user)
+	{
+		const GroupSet* groups = Get(user);
+		if (groups)
+			ServerInstance->PI->SendMetadata(user, name, insp::join(table.GetNames(*groups), ' '));
+	}
+};
+
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
+{
+private:
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
+	{
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+// The per-field mask match results for a local user.
+struct MatchState final
 {
-	return (list && !list->empty()) ? insp::join(*list, ',') : "none";
-}
+	// The groups with a mask that matched nick!user@realhost.
+	GroupSet nick;
+
+	// The groups with a mask that matched user@displayedhost.
+	GroupSet host;
+
+	// The groups with a mask that matched user@realhost, realhost, or the IP address.
+	GroupSet other;
+
+	// The groups whose non-mask requirements (account, TLS, etc) were met.
+	GroupSet requirements;
+
+	// The config generation these results were calculated for.
+	unsigned long generation = 0;
+};
+
+// The masks of every configured security group compiled into lookup tables.
+class MaskMatcher final
+{
+private:
+	typedef std::unordered_map<std::string, GroupSet, irc::insensitive, irc::StrHashComp> LiteralMap;
+
+	// Literal masks in the form nick!user@host.
+	LiteralMap literalmasks;
+
+	// Literal masks in the form user@host.
+	LiteralMap literaluserhosts;
+
+	// Literal masks in the form host.
+	LiteralMap literalhosts;
+
+	// Masks which are a CIDR range.
+	CIDRTree<size_t> cidrs;
+
+	// Masks which contain wildcards and have to be glob matched.
+	std::vector<std::pair<std::string, size_t>> wildcards;
+
+	// The groups which have no masks at all.
+	GroupSet unmasked;
+
+	void MatchWildcards(GroupSet& groups, const std::string& str, bool cidr) const
+	{
+		for (const auto& [mask, group] : wildcards)
+		{
+			if (groups.Test(group))
+				continue; // Already matched.
+
+			if (cidr ? InspIRCd::MatchCIDR(str, mask) : InspIRCd::Match(str, mask))
+				groups.Set(group);
+		}
+	}
+
+	static void MatchLiteral(const LiteralMap& literals, GroupSet& groups, const std::string& str)
+	{
+		auto it = literals.find(str);
+		if (it != literals.end())
+			groups |= it->second;
+	}
+
+public:
+	void Add(const std::string& mask, size_t group)
+	{
+		// Masks in the form [user@]ip/prefix are matched against the IP address
+		// of the user by MatchCIDR which ignores the user part. Masks which are
+		// a bare IP address are only ever matched as text.
+		const auto atpos = mask.rfind('@');
+		const auto hostpart = atpos == std::string::npos ? mask : mask.substr(atpos + 1);
+		if (hostpart.find_first_of("*?") == std::string::npos && hostpart.find('/') != std::string::npos)
+		{
+			irc::sockets::cidr_mask range;
+			irc::sockets::sockaddrs sa;
+			if (CIDRTree<size_t>::ParseRange(hostpart, range))
+				cidrs.Add(range, group);
+			else if (irc::sockets::aptosa(hostpart.substr(0, hostpart.find('/')), 0, sa))
+			{
+				// MatchCIDR is laxer about prefix lengths than we are.
+				wildcards.emplace_back(mask, group);
+				return;
+			}
+		}
+
+		if (mask.find_first_of("*?") != std::string::npos)
+			wildcards.emplace_back(mask, group);
+		else if (mask.find('!') != std::string::npos)
+			literalmasks[mask].Set(group);
+		else if (atpos != std::string::npos)
+			literaluserhosts[mask].Set(group);
+		else
+			literalhosts[mask].Set(group);
+	}
+
+	void AddUnmasked(size_t group)
+	{
+		unmasked.Set(group);
+	}
+
+	GroupSet GetMatches(const MatchState& state) const
+	{
+		GroupSet groups = unmasked;
+		groups |= state.nick;
+		groups |= state.host;
+		groups |= state.other;
+		groups &= state.requirements;
+		return groups;
+	}
+
+	void MatchNick(const std::string& realmask, GroupSet& groups) const
+	{
+		groups = GroupSet();
+		MatchLiteral(literalmasks, groups, realmask);
+		MatchWildcards(groups, realmask, false);
+	}
+
+	void MatchHost(const std::string& userhost, GroupSet& groups) const
+	{
+		groups = GroupSet();
+		MatchLiteral(literaluserhosts, groups, userhost);
+		MatchWildcards(groups, userhost, false);
+	}
+
+	void MatchOther(LocalUser* user, const std::string& realuserhost, GroupSet& groups) const
+	{
+		groups = GroupSet();
+
+		MatchLiteral(literaluserhosts, groups, realuserhost);
+		MatchWildcards(groups, realuserhost, false);
+
+		MatchLiteral(literalhosts, groups, user->GetRealHost());
+		MatchWildcards(groups, user->GetRealHost(), false);
+
+		std::vector<size_t> cidrgroups;
+		cidrs.Find(user->client_sa, cidrgroups);
+		for (const auto group : cidrgroups)
+			groups.Set(group);
+
+		MatchLiteral(literalhosts, groups, user->GetAddress());
+		MatchWildcards(groups, user->GetAddress(), true);
+	}
+};
 
 struct SecurityGroup final
 {
 	std::string name;
+	size_t id = 0;
 	MaskList masks;
 	bool require_account = false;
 	bool require_tls = false;
@@ -64,18 +641,59 @@ struct SecurityGroup final
 	int score_min = -1;
 	int score_max = -1;
 	bool publicgroup = false;
+
+	bool operator==(const SecurityGroup& other) const
+	{
+		return name == other.name
+			&& masks == other.masks
+			&& require_account == other.require_account
+			&& require_tls == other.require_tls
+			&& require_insecure == other.require_insecure
+			&& require_websocket == other.require_websocket
+			&& require_webirc == other.require_webirc
+			&& score_min == other.score_min
+			&& score_max == other.score_max
+			&& publicgroup == other.publicgroup;
+	}
+
+	bool operator!=(const SecurityGroup& other) const
+	{
+		return !(*this == other);
+	}
+};
+
+class RebuildTimer final
+	: public Timer
+{
+private:
+	std::function<void()> callback;
+
+public:
+	RebuildTimer(std::function<void()> cb)
+		: Timer(1, true)
+		, callback(std::move(cb))
+	{
+	}
+
+	bool Tick() override
+	{
+		callback();
+		return true;
+	}
 };
 
 class CommandSecurityGroups final
 	: public Command
 {
 private:
-	ListExtItem<SecurityGroupList>& allgroups;
-	ListExtItem<SecurityGroupList>& publicgroups;
+	const GroupTable& table;
+	GroupSetExtItem& allgroups;
+	GroupSetExtItem& publicgroups;
 
 public:
-	CommandSecurityGroups(Module* Creator, ListExtItem<SecurityGroupList>& all, ListExtItem<SecurityGroupList>& pub)
+	CommandSecurityGroups(Module* Creator, const GroupTable& groups, GroupSetExtItem& all, GroupSetExtItem& pub)
 		: Command(Creator, "SECURITYGROUPS", 0, 1)
+		, table(groups)
 		, allgroups(all)
 		, publicgroups(pub)
 	{
@@ -99,9 +717,9 @@ public:
 		}
 
 		const bool canseeall = self || user->HasPrivPermission("users/auspex");
-		const SecurityGroupList* list = canseeall ? allgroups.Get(target) : publicgroups.Get(target);
+		const GroupSet* list = canseeall ? allgroups.Get(target) : publicgroups.Get(target);
 		user->WriteNotice(INSP_FORMAT("Security groups for {}: {}",
-			target->nick, FormatSecurityGroupList(list)));
+			target->nick, table.Format(list, ',')));
 		return CmdResult::SUCCESS;
 	}
 };
@@ -111,45 +729,81 @@ class ModuleSecurityGroups final
 	, public Account::EventListener
 	, public WebIRC::EventListener
 	, public Whois::EventListener
+	, public Stats::EventListener
+	, public ServerProtocol::LinkEventListener
+	, public ServerProtocol::SyncEventListener
 {
 private:
+	// The network metadata key which servers advertise delta support with.
+	static constexpr const char* DELTA_SUPPORT_KEY = "securitygroups-deltas";
+
 	class SecurityGroupExtBan final
 		: public ExtBan::MatchingBase
 	{
 	private:
-		ListExtItem<SecurityGroupList>& sgext;
+		const GroupTable& table;
+		GroupSetExtItem& sgext;
 
 	public:
-		SecurityGroupExtBan(Module* Creator, ListExtItem<SecurityGroupList>& ext)
+		SecurityGroupExtBan(Module* Creator, const GroupTable& groups, GroupSetExtItem& ext)
 			: ExtBan::MatchingBase(Creator, "securitygroup", 'g')
+			, table(groups)
 			, sgext(ext)
 		{
 		}
 
 		bool IsMatch(User* user, Channel* channel, const std::string& text) override
 		{
-			const SecurityGroupList* list = sgext.Get(user);
-			if (!list || list->empty() || text.empty())
+			const GroupSet* list = sgext.Get(user);
+			if (!list || list->Empty() || text.empty())
 				return false;
 
-			for (const auto& group : *list)
+			// A literal group name only needs to be looked up once.
+			if (text.find_first_of("*?") == std::string::npos)
 			{
-				if (InspIRCd::Match(group, text, ascii_case_insensitive_map))
-					return true;
+				size_t id;
+				return table.Find(text, id) && list->Test(id) && insp::equalsci(table.GetName(id), text);
 			}
 
-			return false;
+			bool matched = false;
+			list->ForEach([this, &matched, &text](size_t id) {
+				if (!matched && InspIRCd::Match(table.GetName(id), text, ascii_case_insensitive_map))
+					matched = true;
+			});
+			return matched;
 		}
 	};
 
+	GroupTable table;
 	std::vector<SecurityGroup> groups;
+	MaskMatcher matcher;
 	bool usesreputation = false;
 
+	// The config generation. Incremented whenever the groups change.
+	unsigned long generation = 0;
+
+	// The UUIDs of the local users which were connected when the groups last
+	// changed and the position of the next one to recalculate.
+	std::vector<std::string> pending;
+	size_t pendingpos = 0;
+
+	// The names of the servers which have advertised support for deltas.
+	std::unordered_set<std::string, irc::insensitive, irc::StrHashComp> deltaservers;
+
+	// Whether every server on the network supports deltas.
+	bool cansenddelta = false;
+
+	// The number of milliseconds per tick to spend recalculating memberships.
+	unsigned long rebuildtime;
+	char statschar;
+	RebuildTimer timer;
+
 	Account::API accountapi;
 	UserCertificateAPI sslapi;
 	BoolExtItem webircext;
-	ListExtItem<SecurityGroupList> sgext;
-	ListExtItem<SecurityGroupList> sgpublicext;
+	GroupSetExtItem sgext;
+	GroupSetExtItem sgpublicext;
+	SimpleExtItem<MatchState> stateext;
 	SecurityGroupExtBan extban;
 	CommandSecurityGroups cmd;
 
@@ -182,28 +836,6 @@ private:
 		return false;
 	}
 
-	static bool MatchesMask(LocalUser* user, const std::string& mask)
-	{
-		if (mask.empty())
-			return true;
-
-		// Check common user masks.
-		if (InspIRCd::Match(user->GetRealMask(), mask))
-			return true;
-		if (InspIRCd::Match(user->GetRealUserHost(), mask))
-			return true;
-		if (InspIRCd::Match(user->GetUserHost(), mask))
-			return true;
-		if (InspIRCd::Match(user->GetRealHost(), mask))
-			return true;
-
-		// Check IP/CIDR.
-		if (InspIRCd::MatchCIDR(user->GetAddress(), mask))
-			return true;
-
-		return false;
-	}
-
 	static IntExtItem* GetReputationExt()
 	{
 		auto* extitem = ServerInstance->Extensions.GetItem("reputation");
@@ -213,23 +845,8 @@ private:
 		return static_cast<IntExtItem*>(extitem);
 	}
 
-	bool Matches(LocalUser* user, const SecurityGroup& group)
+	bool MeetsRequirements(LocalUser* user, const SecurityGroup& group)
 	{
-		if (!group.masks.empty())
-		{
-			bool anymask = false;
-			for (const auto& mask : group.masks)
-			{
-				if (MatchesMask(user, mask))
-				{
-					anymask = true;
-					break;
-				}
-			}
-			if (!anymask)
-				return false;
-		}
-
 		if (group.require_webirc && !webircext.Get(user))
 			return false;
 
@@ -267,30 +884,114 @@ private:
 		return true;
 	}
 
-	void Rebuild(LocalUser* user)
+	void Apply(LocalUser* user, const MatchState& state)
 	{
-		SecurityGroupList matched;
-		SecurityGroupList matchedpublic;
+		GroupSet matched;
+		GroupSet matchedpublic;
 
-		for (const auto& group : groups)
+		const GroupSet matches = matcher.GetMatches(state);
+		for (size_t idx = 0; idx < groups.size(); ++idx)
 		{
-			if (!Matches(user, group))
+			if (!matches.Test(idx))
 				continue;
 
-			matched.insert(group.name);
+			const auto& group = groups[idx];
+			matched.Set(group.id);
 			if (group.publicgroup)
-				matchedpublic.insert(group.name);
+				matchedpublic.Set(group.id);
 		}
 
-		if (matched.empty())
-			sgext.Unset(user);
-		else
-			sgext.Set(user, matched);
+		sgext.SetGroups(user, matched, cansenddelta);
+		sgpublicext.SetGroups(user, matchedpublic, cansenddelta);
+	}
 
-		if (matchedpublic.empty())
-			sgpublicext.Unset(user);
-		else
-			sgpublicext.Set(user, matchedpublic);
+	void CheckDeltaSupport()
+	{
+		ProtocolInterface::ServerList servers;
+		ServerInstance->PI->GetServerList(servers);
+
+		cansenddelta = true;
+		for (const auto& server : servers)
+		{
+			if (!deltaservers.count(server.servername))
+			{
+				cansenddelta = false;
+				break;
+			}
+		}
+	}
+
+	void Rebuild(LocalUser* user)
+	{
+		MatchState state;
+		matcher.MatchNick(user->GetRealMask(), state.nick);
+		matcher.MatchHost(user->GetUserHost(), state.host);
+		matcher.MatchOther(user, user->GetRealUserHost(), state.other);
+		for (size_t idx = 0; idx < groups.size(); ++idx)
+		{
+			if (MeetsRequirements(user, groups[idx]))
+				state.requirements.Set(idx);
+		}
+
+		state.generation = generation;
+		Apply(user, state);
+		stateext.Set(user, state);
+	}
+
+	void StartRebuild()
+	{
+		// Users who connect from now on are matched against the new groups
+		// straight away. Existing users keep their old memberships until the
+		// timer reaches them.
+		generation++;
+		pending.clear();
+		pendingpos = 0;
+		for (auto* user : ServerInstance->Users.GetLocalUsers())
+			pending.push_back(user->uuid);
+	}
+
+	void ContinueRebuild()
+	{
+		if (pendingpos >= pending.size())
+			return;
+
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(rebuildtime);
+		while (pendingpos < pending.size())
+		{
+			User* user = ServerInstance->Users.FindUUID(pending[pendingpos++]);
+			LocalUser* luser = user && !user->quitting ? IS_LOCAL(user) : nullptr;
+			if (luser)
+			{
+				// The user may have already been recalculated if something
+				// else changed since the rebuild started.
+				const MatchState* state = stateext.Get(luser);
+				if (!state || state->generation != generation)
+					Rebuild(luser);
+			}
+
+			if (std::chrono::steady_clock::now() >= deadline)
+				break;
+		}
+
+		if (pendingpos >= pending.size())
+		{
+			ServerInstance->Logs.Debug(MODNAME, "Finished recalculating the security groups of {} users", pending.size());
+			pending.clear();
+			pendingpos = 0;
+		}
+	}
+
+	MatchState* GetCurrentState(LocalUser* user)
+	{
+		// If the user has not been recalculated since the groups changed then
+		// recalculate them entirely.
+		MatchState* state = stateext.Get(user);
+		if (state && state->generation != generation)
+		{
+			Rebuild(user);
+			state = stateext.Get(user);
+		}
+		return state;
 	}
 
 public:
@@ -299,19 +1000,103 @@ public:
 		, Account::EventListener(this)
 		, WebIRC::EventListener(this)
 		, Whois::EventListener(this)
+		, Stats::EventListener(this)
+		, ServerProtocol::LinkEventListener(this)
+		, ServerProtocol::SyncEventListener(this)
 		, accountapi(this)
 		, sslapi(this)
 		, webircext(this, "securitygroups-webirc", ExtensionType::USER)
-		, sgext(this, "securitygroups", ExtensionType::USER, true)
-		, sgpublicext(this, "securitygroups-public", ExtensionType::USER, true)
-		, extban(this, sgext)
-		, cmd(this, sgext, sgpublicext)
+		, sgext(this, "securitygroups", table)
+		, sgpublicext(this, "securitygroups-public", table)
+		, stateext(this, "securitygroups-state", ExtensionType::USER)
+		, extban(this, table, sgext)
+		, cmd(this, table, sgext, sgpublicext)
+		, timer([this]() { ContinueRebuild(); })
+	{
+	}
+
+	void init() override
+	{
+		ServerInstance->Timers.AddTimer(&timer);
+
+		// Servers which already have this module loaded will resend the full
+		// groups of their users and respond with their own advertisement.
+		deltaservers.insert(ServerInstance->Config->ServerName);
+		ServerInstance->PI->SendMetadata(DELTA_SUPPORT_KEY, ServerInstance->Config->ServerName + " reset");
+		CheckDeltaSupport();
+	}
+
+	void OnDecodeMetadata(Extensible* target, const std::string& extname, const std::string& extvalue) override
+	{
+		if (!target)
+		{
+			if (!irc::equals(extname, DELTA_SUPPORT_KEY))
+				return;
+
+			// The advertisement is "<server> [reset]" where reset means that
+			// the server has just (re)loaded this module and knows nothing.
+			irc::spacesepstream advertstream(extvalue);
+			std::string servername;
+			std::string flag;
+			if (!advertstream.GetToken(servername) || irc::equals(servername, ServerInstance->Config->ServerName))
+				return;
+
+			deltaservers.insert(servername);
+			if (advertstream.GetToken(flag) && irc::equals(flag, "reset"))
+			{
+				// Even if we already knew about this server it may have lost
+				// the groups that earlier deltas were applied to. Our reply
+				// is not a reset so this can not bounce back and forth.
+				for (auto* user : ServerInstance->Users.GetLocalUsers())
+				{
+					sgext.SendFull(user);
+					sgpublicext.SendFull(user);
+				}
+				ServerInstance->PI->SendMetadata(DELTA_SUPPORT_KEY, ServerInstance->Config->ServerName);
+			}
+			CheckDeltaSupport();
+			return;
+		}
+
+		if (target->extype != ExtensionType::USER)
+			return;
+
+		auto* user = static_cast<User*>(target);
+		if (irc::equals(extname, sgext.deltakey))
+			sgext.FromDelta(user, extvalue);
+		else if (irc::equals(extname, sgpublicext.deltakey))
+			sgpublicext.FromDelta(user, extvalue);
+	}
+
+	void OnServerLink(const Server* server) override
 	{
+		// Services never read security groups so they do not need to support
+		// deltas. Other servers have to advertise support first.
+		if (server->IsService())
+			deltaservers.insert(server->GetName());
+		CheckDeltaSupport();
+	}
+
+	void OnServerSplit(const Server* server, bool error) override
+	{
+		deltaservers.erase(server->GetName());
+		CheckDeltaSupport();
+	}
+
+	void OnSyncNetwork(ProtocolServer& server) override
+	{
+		for (const auto& servername : deltaservers)
+			server.SendMetadata(DELTA_SUPPORT_KEY, servername);
 	}
 
 	void ReadConfig(ConfigStatus& status) override
 	{
+		const auto& sgtag = ServerInstance->Config->ConfValue("securitygroups");
+		rebuildtime = sgtag->getNum<unsigned long>("rebuildtime", 50, 1, 1000);
+		statschar = sgtag->getCharacter("statschar", 'G');
+
 		std::vector<SecurityGroup> newgroups;
+		MaskMatcher newmatcher;
 		usesreputation = false;
 
 		for (const auto& [_, tag] : ServerInstance->Config->ConfTags("securitygroup"))
@@ -320,10 +1105,16 @@ public:
 			group.name = tag->getString("name", "", 1);
 			if (group.name.empty())
 				throw ModuleException(this, "<securitygroup:name> is empty at " + tag->source.str());
+			group.id = table.Intern(group.name);
 
 			irc::spacesepstream maskstream(tag->getString("mask"));
 			for (std::string mask; maskstream.GetToken(mask); )
+			{
 				group.masks.push_back(mask);
+				newmatcher.Add(mask, newgroups.size());
+			}
+			if (group.masks.empty())
+				newmatcher.AddUnmasked(newgroups.size());
 
 			group.publicgroup = tag->getBool("public", false);
 
@@ -350,10 +1141,12 @@ public:
 		if (usesreputation && !GetReputationExt())
 			throw ModuleException(this, "<securitygroup> uses scoremin/scoremax but the reputation user extension (from the reputation module) is not loaded");
 
-		groups.swap(newgroups);
+		if (newgroups == groups)
+			return; // Nothing changed.
 
-		for (auto* user : ServerInstance->Users.GetLocalUsers())
-			Rebuild(user);
+		groups.swap(newgroups);
+		std::swap(matcher, newmatcher);
+		StartRebuild();
 	}
 
 	void OnUnloadModule(Module* mod) override
@@ -376,6 +1169,63 @@ public:
 		Rebuild(user);
 	}
 
+	void OnUserPostNick(User* user, const std::string& oldnick) override
+	{
+		// Only the masks which are matched against nick!user@host can change.
+		LocalUser* luser = IS_LOCAL(user);
+		MatchState* state = luser ? GetCurrentState(luser) : nullptr;
+		if (!state)
+			return;
+
+		matcher.MatchNick(luser->GetRealMask(), state->nick);
+		Apply(luser, *state);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) override
+	{
+		// Only the masks which are matched against user@displayedhost can
+		// change. This is called before the host is changed so we have to
+		// build the new user@host ourself.
+		LocalUser* luser = IS_LOCAL(user);
+		MatchState* state = luser ? GetCurrentState(luser) : nullptr;
+		if (!state)
+			return;
+
+		matcher.MatchHost(luser->GetDisplayedUser() + "@" + newhost, state->host);
+		Apply(luser, *state);
+	}
+
+	void OnChangeRealUser(User* user, const std::string& newuser) override
+	{
+		// Every mask which contains the real username can change. Like with
+		// OnChangeHost this is called before the username is changed.
+		LocalUser* luser = IS_LOCAL(user);
+		MatchState* state = luser ? GetCurrentState(luser) : nullptr;
+		if (!state)
+			return;
+
+		matcher.MatchNick(luser->nick + "!" + newuser + "@" + luser->GetRealHost(), state->nick);
+		matcher.MatchOther(luser, newuser + "@" + luser->GetRealHost(), state->other);
+
+		// The displayed username follows the real one unless it was changed.
+		if (luser->GetDisplayedUser() == luser->GetRealUser())
+			matcher.MatchHost(newuser + "@" + luser->GetDisplayedHost(), state->host);
+		Apply(luser, *state);
+	}
+
+	void OnChangeDisplayedUser(User* user, const std::string& newuser) override
+	{
+		// Only the masks which are matched against user@displayedhost can
+		// change. This is called before the username is changed.
+		LocalUser* luser = IS_LOCAL(user);
+		MatchState* state = luser ? GetCurrentState(luser) : nullptr;
+		if (!state)
+			return;
+
+		matcher.MatchHost(newuser + "@" + luser->GetDisplayedHost(), state->host);
+		Apply(luser, *state);
+	}
+
 	void OnAccountChange(User* user, const std::string& newaccount) override
 	{
 		LocalUser* luser = IS_LOCAL(user);
@@ -395,14 +1245,32 @@ public:
 		Rebuild(user);
 	}
 
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() != statschar)
+			return MOD_RES_PASSTHRU;
+
+		if (pendingpos < pending.size())
+		{
+			stats.AddGenericRow(INSP_FORMAT("securitygroups: generation {} recalculating, {} of {} users done ({}%)",
+				generation, pendingpos, pending.size(), pendingpos * 100 / pending.size()));
+		}
+		else
+		{
+			stats.AddGenericRow(INSP_FORMAT("securitygroups: generation {} up to date, {} groups",
+				generation, groups.size()));
+		}
+		return MOD_RES_DENY;
+	}
+
 	void OnWhois(Whois::Context& whois) override
 	{
 		const bool canseeall = whois.IsSelfWhois() || whois.GetSource()->HasPrivPermission("users/auspex");
-		const SecurityGroupList* list = canseeall ? sgext.Get(whois.GetTarget()) : sgpublicext.Get(whois.GetTarget());
-		if (!list || list->empty())
+		const GroupSet* list = canseeall ? sgext.Get(whois.GetTarget()) : sgpublicext.Get(whois.GetTarget());
+		if (!list || list->Empty())
 			return;
 
-		whois.SendLine(RPL_WHOISSPECIAL, "is in security groups: " + insp::join(*list, ','));
+		whois.SendLine(RPL_WHOISSPECIAL, "is in security groups: " + table.Format(list, ','));
 	}
 };
 
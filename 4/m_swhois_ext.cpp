@@ -28,6 +28,49 @@
 #include "modules/whois.h"
 #include "numerichelper.h"
 
+// Interns swhois messages so that users with the same message (e.g. from an
+// oper block) share a single copy of it.
+class SWhoisPool final
+{
+private:
+	std::unordered_map<std::string, std::weak_ptr<const std::string>> messages;
+
+	// The number of messages interned since expired entries were last purged.
+	size_t interned = 0;
+
+public:
+	std::shared_ptr<const std::string> Intern(const std::string& msg)
+	{
+		auto& entry = messages[msg];
+		auto message = entry.lock();
+		if (!message)
+		{
+			message = std::make_shared<const std::string>(msg);
+			entry = message;
+		}
+
+		// Entries expire when the last user with the message loses it so they
+		// need to be purged every so often.
+		if (++interned >= messages.size())
+		{
+			interned = 0;
+			for (auto it = messages.begin(); it != messages.end(); )
+			{
+				if (it->second.expired())
+					it = messages.erase(it);
+				else
+					++it;
+			}
+		}
+		return message;
+	}
+};
+
+namespace
+{
+	SWhoisPool swhoispool;
+}
+
 struct SWhois final
 {
 	enum Flags
@@ -56,15 +99,15 @@ struct SWhois final
 	time_t priority = ServerInstance->Time();
 
 	// The swhois message.
-	std::string message;
+	std::shared_ptr<const std::string> message;
 
 	// The tag for referencing this message in S2S.
 	std::string tag;
 
 	bool operator <(const SWhois& other) const
 	{
-		return std::tie(priority, tag, message, other.flags)
-			< std::tie(other.priority, other.tag, other.message, other.flags);
+		return std::tie(priority, tag, *message, other.flags)
+			< std::tie(other.priority, other.tag, *other.message, other.flags);
 	}
 
 	std::string GetFlags() const
@@ -97,19 +140,54 @@ struct SWhois final
 	std::string SerializeAdd() const
 	{
 		return INSP_FORMAT("+ @{} {} {} :{}", this->tag, this->GetFlags(),
-			this->priority, this->message);
+			this->priority, *this->message);
 	}
 
 	std::string SerializeDel() const
 	{
 		if (this->tag.empty())
-			return INSP_FORMAT("- :{}", this->message);
+			return INSP_FORMAT("- :{}", *this->message);
 		else
 			return INSP_FORMAT("- @{}", this->tag);
 	}
 };
 
-using SWhoisList = std::vector<SWhois>;
+// The swhois entries of a user in priority order.
+class SWhoisList final
+	: public std::vector<SWhois>
+{
+public:
+	using BurstLine = std::pair<std::string, std::string>;
+
+private:
+	// The metadata to send when bursting the user. This is built on demand and
+	// discarded whenever the list changes.
+	mutable std::vector<BurstLine> burst;
+	mutable bool burstvalid = false;
+
+public:
+	void Invalidate()
+	{
+		burst.clear();
+		burstvalid = false;
+	}
+
+	const std::vector<BurstLine>& GetBurst() const
+	{
+		if (!burstvalid)
+		{
+			for (const auto& swhois : *this)
+			{
+				if (swhois.flags & SWhois::FLAG_COMPAT)
+					burst.emplace_back("swhois", *swhois.message);
+				else
+					burst.emplace_back("specialwhois", swhois.SerializeAdd());
+			}
+			burstvalid = true;
+		}
+		return burst;
+	}
+};
 
 using SWhoisExtItem = SimpleExtItem<SWhoisList>;
 
@@ -126,11 +204,12 @@ namespace
 
 		// If the message is empty we use a space to avoid client formatting issues.
 		SWhois swhois;
-		swhois.message = msg.empty() ? " " : msg;
+		swhois.message = swhoispool.Intern(msg.empty() ? " " : msg);
 		if (priority)
 			swhois.priority = priority;
 
 		// Insert sorted so we get the right order on iteration.
+		swhoislist->Invalidate();
 		auto pos = std::upper_bound(swhoislist->begin(), swhoislist->end(), swhois);
 		return *swhoislist->insert(pos, swhois);
 	}
@@ -141,26 +220,34 @@ namespace
 		if (!swhoislist)
 			return false; // Nothing to delete.
 
-		auto it = std::remove_if(swhoislist->begin(), swhoislist->end(), [&from_network, &predicate](const SWhois& swhois) {
-			if (!from_network && (swhois.flags & SWhois::FLAG_SERVER_SET))
-				return false;
-			return predicate(swhois);
-		});
-		if (it == swhoislist->end())
-			return false; // Nothing deleted.
-
-		if (!from_network)
+		// The predicate is called in list order as some of them count entries.
+		// Each entry is sent to the network before it is erased as erasing
+		// moves the entries after it.
+		bool deleted = false;
+		for (auto it = swhoislist->begin(); it != swhoislist->end(); )
 		{
-			for (auto sit = it; sit != swhoislist->end(); ++sit)
+			if ((!from_network && (it->flags & SWhois::FLAG_SERVER_SET)) || !predicate(*it))
+			{
+				++it;
+				continue;
+			}
+
+			if (!from_network)
 			{
-				if (sit->flags & SWhois::FLAG_COMPAT)
+				if (it->flags & SWhois::FLAG_COMPAT)
 					ServerInstance->PI->SendMetadata(user, "swhois", "");
 				else
-					ServerInstance->PI->SendMetadata(user, "specialwhois", sit->SerializeDel());
+					ServerInstance->PI->SendMetadata(user, "specialwhois", it->SerializeDel());
 			}
+
+			it = swhoislist->erase(it);
+			deleted = true;
 		}
 
-		swhoislist->erase(it, swhoislist->end());
+		if (!deleted)
+			return false; // Nothing deleted.
+
+		swhoislist->Invalidate();
 		if (swhoislist->empty())
 			swhoisext.Unset(user);
 		return true;
@@ -194,7 +281,7 @@ private:
 		ServerInstance->PI->SendMetadata(target, "specialwhois", swhois.SerializeAdd());
 
 		noterpl.SendIfCap(source, stdrplcap, this, "ENTRY_ADDED", target->nick, INSP_FORMAT("Added special whois for {}: {}",
-			target->nick, swhois.message));
+			target->nick, *swhois.message));
 		return CmdResult::SUCCESS;
 	}
 
@@ -234,7 +321,7 @@ private:
 		if (!deleted)
 		{
 			deleted = DelSWhois(swhoisext, source, [&msg](const SWhois& swhois) {
-				return msg == swhois.message;
+				return msg == *swhois.message;
 			});
 		}
 
@@ -265,7 +352,7 @@ private:
 		for (const auto& swhois : *swhoislist)
 		{
 			noterpl.SendIfCap(source, stdrplcap, this, "LIST_ENTRY", target->nick, INSP_FORMAT("#{}: {} (priority: {}, flags: {})",
-				++index, swhois.message, swhois.priority, swhois.GetFlags()));
+				++index, *swhois.message, swhois.priority, swhois.GetFlags()));
 		}
 
 		return CmdResult::SUCCESS;
@@ -370,7 +457,7 @@ private:
 		if (!deleted)
 		{
 			DelSWhois(cmdswhois.swhoisext, user, [&message](const SWhois& swhois) {
-				return swhois.message == message;
+				return *swhois.message == message;
 			}, true);
 		}
 	}
@@ -450,13 +537,8 @@ public:
 		if (!swhoislist)
 			return;
 
-		for (const auto& swhois : *swhoislist)
-		{
-			if (swhois.flags & SWhois::FLAG_COMPAT)
-				server.SendMetadata(user, "swhois", swhois.message);
-			else
-				server.SendMetadata(user, "specialwhois", swhois.SerializeAdd());
-		}
+		for (const auto& [key, value] : swhoislist->GetBurst())
+			server.SendMetadata(user, key, value);
 	}
 
 	ModResult OnWhoisLine(Whois::Context& whois, Numeric::Numeric& numeric) override
@@ -478,7 +560,7 @@ public:
 			if (swhois.flags & SWhois::FLAG_OPER_ONLY && !has_priv)
 				continue; // This swhois is only available to opers.
 
-			whois.SendLine(RPL_WHOISSPECIAL, swhois.message);
+			whois.SendLine(RPL_WHOISSPECIAL, *swhois.message);
 		}
 		return MOD_RES_PASSTHRU;
 	}
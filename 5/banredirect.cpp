@@ -56,6 +56,263 @@ public:
 
 typedef std::vector<BanRedirectEntry> BanRedirectList;
 
+// A binary radix tree of CIDR ranges which finds the values of every range
+// that contains an IP address in O(prefix length).
+template <typename Value>
+class CIDRTree final
+{
+private:
+	struct Node final
+	{
+		std::unique_ptr<Node> children[2];
+		std::vector<Value> values;
+	};
+
+	Node root4;
+	Node root6;
+
+	// The number of values in the tree.
+	size_t count = 0;
+
+	static bool GetBit(const unsigned char* bytes, size_t bit)
+	{
+		return bytes[bit / 8] & (0x80 >> (bit % 8));
+	}
+
+	// Retrieves the root node and the bytes of an IP address.
+	const Node* GetRoot(const irc::sockets::sockaddrs& sa, const unsigned char*& bytes, size_t& length) const
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				bytes = reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr);
+				length = 32;
+				return &root4;
+
+			case AF_INET6:
+				bytes = sa.in6.sin6_addr.s6_addr;
+				length = 128;
+				return &root6;
+
+			default:
+				return nullptr;
+		}
+	}
+
+	// Removes a value from the node of a range and returns whether the node can be pruned.
+	bool Remove(Node& node, const irc::sockets::cidr_mask& range, size_t depth, const Value& value, bool& removed)
+	{
+		if (depth >= range.length)
+		{
+			auto it = std::find(node.values.begin(), node.values.end(), value);
+			if (it != node.values.end())
+			{
+				node.values.erase(it);
+				removed = true;
+			}
+		}
+		else
+		{
+			auto& child = node.children[GetBit(range.bits, depth)];
+			if (child && Remove(*child, range, depth + 1, value, removed))
+				child.reset();
+		}
+		return node.values.empty() && !node.children[0] && !node.children[1];
+	}
+
+public:
+	// Parses an IP address or a CIDR range. A prefix length is only accepted if
+	// it is a number which is valid for the address family.
+	static bool ParseRange(const std::string& str, irc::sockets::cidr_mask& range)
+	{
+		const auto slashpos = str.find('/');
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(str.substr(0, slashpos), 0, sa))
+			return false;
+
+		const unsigned int maxlength = sa.family() == AF_INET ? 32 : 128;
+		unsigned int length = maxlength;
+		if (slashpos != std::string::npos)
+		{
+			const std::string prefix = str.substr(slashpos + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = 0;
+			for (const auto chr : prefix)
+				length = length * 10 + (chr - '0');
+
+			if (length > maxlength)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, static_cast<unsigned char>(length));
+		return true;
+	}
+
+	void Add(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; depth < range.length; ++depth)
+		{
+			auto& child = node->children[GetBit(range.bits, depth)];
+			if (!child)
+				child = std::make_unique<Node>();
+			node = child.get();
+		}
+		node->values.push_back(value);
+		count++;
+	}
+
+	bool Remove(const irc::sockets::cidr_mask& range, const Value& value)
+	{
+		bool removed = false;
+		Remove(range.type == AF_INET ? root4 : root6, range, 0, value, removed);
+		if (removed)
+			count--;
+		return removed;
+	}
+
+	void Clear()
+	{
+		root4 = Node();
+		root6 = Node();
+		count = 0;
+	}
+
+	// Retrieves the values of exactly the specified range.
+	const std::vector<Value>* Get(const irc::sockets::cidr_mask& range) const
+	{
+		const Node* node = range.type == AF_INET ? &root4 : &root6;
+		for (size_t depth = 0; node && depth < range.length; ++depth)
+			node = node->children[GetBit(range.bits, depth)].get();
+		return node && !node->values.empty() ? &node->values : nullptr;
+	}
+
+	// Appends the values of every range which contains the specified IP address
+	// from the least specific range to the most specific range.
+	void Find(const irc::sockets::sockaddrs& sa, std::vector<Value>& values) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			values.insert(values.end(), node->values.begin(), node->values.end());
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+	}
+
+	// Determines whether any range contains the specified IP address.
+	bool Contains(const irc::sockets::sockaddrs& sa) const
+	{
+		const unsigned char* bytes;
+		size_t length;
+		const Node* node = GetRoot(sa, bytes, length);
+		for (size_t depth = 0; node; ++depth)
+		{
+			if (!node->values.empty())
+				return true;
+			if (depth >= length)
+				break;
+			node = node->children[GetBit(bytes, depth)].get();
+		}
+		return false;
+	}
+
+	size_t GetSize() const
+	{
+		return count;
+	}
+};
+
+// Indexes the redirecting bans of a channel by the host part of their mask so
+// that a joining user only has to be matched against the ones which can apply.
+class BanRedirectIndex final
+{
+private:
+	// Entries with an ip[/prefix] host.
+	CIDRTree<size_t> cidrs;
+
+	// Entries with a host that contains no wildcards. This folds case the same
+	// way as the matching of ban masks does.
+	std::unordered_map<std::string, std::vector<size_t>, irc::insensitive, irc::StrHashComp> literals;
+
+	// Entries which have to be checked against every user.
+	std::vector<size_t> wildcards;
+
+	void FindHost(const std::string& host, std::vector<size_t>& entries) const
+	{
+		auto it = literals.find(host);
+		if (it != literals.end())
+			entries.insert(entries.end(), it->second.begin(), it->second.end());
+
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(host, 0, sa))
+			cidrs.Find(sa, entries);
+	}
+
+public:
+	// The number of entries in the list this index was built from.
+	const size_t size;
+
+	BanRedirectIndex(const BanRedirectList& redirects)
+		: size(redirects.size())
+	{
+		for (size_t idx = 0; idx < redirects.size(); ++idx)
+		{
+			// Ban masks are always in the form nick!user@host by the time they
+			// are stored. As users only have one @ the host part of the mask
+			// has to match the host part of the user.
+			const std::string& banmask = redirects[idx].banmask;
+			const auto atpos = banmask.find('@', banmask.find('!'));
+			if (atpos == std::string::npos || banmask.find('@', atpos + 1) != std::string::npos)
+			{
+				wildcards.push_back(idx);
+				continue;
+			}
+
+			// Hosts which contain wildcards have to be checked in full.
+			const std::string host = banmask.substr(atpos + 1);
+			irc::sockets::cidr_mask range;
+			irc::sockets::sockaddrs sa;
+			if (host.empty() || host.find_first_of("*?") != std::string::npos)
+			{
+				wildcards.push_back(idx);
+			}
+			else if (CIDRTree<size_t>::ParseRange(host, range))
+			{
+				cidrs.Add(range, idx);
+				literals[host].push_back(idx);
+			}
+			else if (host.find('/') != std::string::npos && irc::sockets::aptosa(host.substr(0, host.find('/')), 0, sa))
+			{
+				// MatchCIDR is laxer about prefix lengths than we are.
+				wildcards.push_back(idx);
+			}
+			else
+			{
+				literals[host].push_back(idx);
+			}
+		}
+	}
+
+	// Retrieves the entries which may match the user in list order.
+	void Find(LocalUser* user, std::vector<size_t>& entries) const
+	{
+		entries = wildcards;
+		cidrs.Find(user->client_sa, entries);
+		FindHost(user->GetRealHost(), entries);
+		FindHost(user->GetDisplayedHost(), entries);
+		FindHost(user->GetAddress(), entries);
+
+		std::sort(entries.begin(), entries.end());
+		entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+	}
+};
+
 class BanRedirect final
 	: public ModeWatcher
 {
@@ -63,13 +320,28 @@ public:
 	ChanModeReference banmode;
 	ExtBan::ManagerRef extbanmgr;
 	SimpleExtItem<BanRedirectList> redirectlist;
+	SimpleExtItem<BanRedirectIndex> redirectindex;
 
 	BanRedirect(const WeakModulePtr& parent)
 		: ModeWatcher(parent, "ban", MODETYPE_CHANNEL)
 		, banmode(parent, "ban")
 		, extbanmgr(parent)
 		, redirectlist(parent, "banredirect", ExtensionType::CHANNEL)
+		, redirectindex(parent, "banredirect-index", ExtensionType::CHANNEL)
+	{
+	}
+
+	const BanRedirectIndex* GetIndex(Channel* channel, const BanRedirectList& redirects)
 	{
+		// The index is dropped whenever the list changes but check the size in
+		// case the list was changed some other way.
+		auto* index = redirectindex.Get(channel);
+		if (!index || index->size != redirects.size())
+		{
+			index = new BanRedirectIndex(redirects);
+			redirectindex.Set(channel, index);
+		}
+		return index;
 	}
 
 	bool BeforeMode(User* source, User* dest, Channel* channel, Modes::Change& change) override
@@ -221,6 +493,7 @@ public:
 
 					/* Here 'param' doesn't have the channel on it yet */
 					redirects->emplace_back(mask[CHAN], change.param);
+					redirectindex.Unset(channel);
 
 					/* Now it does */
 					change.param.append(mask[CHAN]);
@@ -238,6 +511,7 @@ public:
 							if ((insp::casemapped_equals(redir->targetchan, mask[CHAN])) && (insp::casemapped_equals(redir->banmask, change.param)))
 							{
 								redirects->erase(redir);
+								redirectindex.Unset(channel);
 
 								if(redirects->empty())
 								{
@@ -320,8 +594,11 @@ public:
 				std::string ipmask(user->nick);
 				ipmask.append(1, '!').append(user->GetUserAddress());
 
-				for (const auto& redirect : *redirects)
+				std::vector<size_t> candidates;
+				banwatcher.GetIndex(chan, *redirects)->Find(user, candidates);
+				for (const auto idx : candidates)
 				{
+					const auto& redirect = (*redirects)[idx];
 					if (InspIRCd::Match(user->GetRealMask(), redirect.banmask) || InspIRCd::Match(user->GetMask(), redirect.banmask) || InspIRCd::MatchCIDR(ipmask, redirect.banmask))
 					{
 						/* This prevents recursion when a user sets multiple ban redirects in a chain